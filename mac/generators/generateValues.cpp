@@ -13,6 +13,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <algorithm>
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -40,6 +42,39 @@ static std::string strip(const char* in)
     return out;
 }
 
+// FNV-1a with a variable seed. Must match the hash in the generated findSharedAtom()
+static uint32_t hashString(const char* s, uint32_t seed)
+{
+    uint32_t hash = seed;
+    for ( ; *s; ++s) {
+        hash = (hash ^ uint8_t(*s)) * 16777619u;
+    }
+    return hash;
+}
+
+// Find a seed which hashes every string to a different slot of a table
+// of size entries. Returns false if there is none in a reasonable time
+static bool findPerfectHash(const std::vector<std::string>& strings, uint32_t size, uint32_t& seed)
+{
+    std::vector<bool> used;
+    for (seed = 2166136261u; seed < 2166136261u + 1000000; ++seed) {
+        used.assign(size, false);
+        bool collision = false;
+        for (const auto& it : strings) {
+            uint32_t slot = hashString(it.c_str(), seed) & (size - 1);
+            if (used[slot]) {
+                collision = true;
+                break;
+            }
+            used[slot] = true;
+        }
+        if (!collision) {
+            return true;
+        }
+    }
+    return false;
+}
+
 int main(int argc, const char* argv[])
 {
     // first arg is a filename containing the strings. Second arg is
@@ -89,7 +124,8 @@ int main(int argc, const char* argv[])
     fprintf(cppfile, "// This file is generated. Do not edit\n\n");
     fprintf(cppfile, "#include \"GeneratedValues.h\"\n");
     fprintf(cppfile, "#include \"Defines.h\"\n");
-    fprintf(cppfile, "#include <cstdlib>\n\n");
+    fprintf(cppfile, "#include <cstdlib>\n");
+    fprintf(cppfile, "#include <cstring>\n\n");
     if (ns) {
         fprintf(cppfile, "using namespace %s;\n\n", ns);
     }
@@ -152,9 +188,44 @@ int main(int argc, const char* argv[])
     }
     fprintf(cppfile, "};\n\n");
     
+    // Write a perfect hash table of the strings, so the loader can find
+    // a shared atom without searching. Start with a table 4 times the
+    // number of strings and double it until a seed is found
+    std::vector<std::string> atomStrings;
+    for (const auto& it : strings) {
+        atomStrings.push_back((it.back() == '$') ? it.substr(0, it.size() - 1) : it);
+    }
+    
+    uint32_t hashSize = 1;
+    while (hashSize < atomStrings.size() * 4) {
+        hashSize <<= 1;
+    }
+    uint32_t seed;
+    while (!findPerfectHash(atomStrings, hashSize, seed)) {
+        hashSize <<= 1;
+    }
+    
+    std::vector<uint16_t> hashTable(hashSize, 0xffff);
+    for (uint16_t i = 0; i < atomStrings.size(); ++i) {
+        hashTable[hashString(atomStrings[i].c_str(), seed) & (hashSize - 1)] = i;
+    }
+    
+    fprintf(cppfile, "// Index in _%s_sharedAtoms of the string hashing to each slot, 0xffff if none\n", ns);
+    fprintf(cppfile, "static const uint16_t _%s_sharedAtomHash[%d] = {", ns, hashSize);
+    for (uint32_t i = 0; i < hashSize; ++i) {
+        if (hashTable[i] == 0xffff) {
+            fprintf(cppfile, "%s0xffff,", (i % 16) ? " " : "\n    ");
+        } else {
+            fprintf(cppfile, "%s%d,", (i % 16) ? " " : "\n    ", hashTable[i]);
+        }
+    }
+    fprintf(cppfile, "\n};\n\n");
+    
     // Write the postambles
     fprintf(hfile, "};\n\n");
     fprintf(hfile, "const char** sharedAtoms(uint16_t& nelts);\n");
+    fprintf(hfile, "\n// Index of s in sharedAtoms(), or -1 if it isn't a shared atom. No search\n");
+    fprintf(hfile, "int32_t findSharedAtom(const char* s);\n\n");
     fprintf(hfile, "const char* specialChars();\n");
     fprintf(hfile, "static inline m8r::Atom SAtom(SA sa) { return m8r::Atom(static_cast<m8r::Atom::value_type>(sa)); }\n");
 
@@ -168,6 +239,17 @@ int main(int argc, const char* argv[])
     fprintf(cppfile, "    return _%s_sharedAtoms;\n", ns);
     fprintf(cppfile, "}\n");
     fprintf(cppfile, "\n");
+    
+    fprintf(cppfile, "int32_t %s::findSharedAtom(const char* s)\n", ns);
+    fprintf(cppfile, "{\n");
+    fprintf(cppfile, "    uint32_t hash = %uu;\n", seed);
+    fprintf(cppfile, "    for (const char* p = s; *p; ++p) {\n");
+    fprintf(cppfile, "        hash = (hash ^ uint8_t(*p)) * 16777619u;\n");
+    fprintf(cppfile, "    }\n");
+    fprintf(cppfile, "    uint16_t index = _%s_sharedAtomHash[hash & %du];\n", ns, hashSize - 1);
+    fprintf(cppfile, "    return (index != 0xffff && strcmp(_%s_sharedAtoms[index], s) == 0) ? index : -1;\n", ns);
+    fprintf(cppfile, "}\n");
+    fprintf(cppfile, "\n");
 
     fclose(afile);
     fclose(hfile);
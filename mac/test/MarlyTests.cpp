@@ -0,0 +1,539 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "MarlyTests.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Marly.h"
+#include "MarlyCode.h"
+#include "MarlyProgram.h"
+#include "MarlyScheduler.h"
+
+using namespace marly;
+
+namespace {
+
+// Image bytes as a Stream, for Marly::load()
+class ImageStream : public m8r::Stream
+{
+public:
+    ImageStream(const uint8_t* image, uint32_t size) : _image(image), _size(size) { }
+
+    virtual bool eof() const override { return _index >= _size; }
+    virtual int read() const override { return eof() ? -1 : _image[_index++]; }
+    virtual int write(uint8_t) override { return -1; }
+
+private:
+    const uint8_t* _image;
+    uint32_t _size;
+    mutable uint32_t _index = 0;
+};
+
+// Magic, version, opcode count, shared atoms hash and size, see
+// Program::readImage()
+static constexpr uint32_t ImageHeaderSize = 16;
+
+// Damaged images which load are run this far, in case the damage made a
+// loop which never ends
+static constexpr uint32_t DamagedSliceSteps = 1000;
+static constexpr uint32_t DamagedSlices = 20;
+
+m8r::String* capture = nullptr;
+int failures = 0;
+
+// Set from the directives of the script being run
+struct Options
+{
+    uint32_t stackSize = 0;
+    uint32_t chunkSize = 0;
+    uint32_t formSize = Marly::DefaultMaxFormSize;
+    uint32_t tasks = 0;
+    uint32_t budget = 0;
+    int64_t sliceTime = 0;
+    m8r::String fire;
+};
+
+Options options;
+
+void fail(const char* file, const char* what, const char* detail = nullptr)
+{
+    ++failures;
+    printf("FAIL %s: %s%s%s\n", file, what, detail ? ", " : "", detail ? detail : "");
+}
+
+bool readFile(const char* file, m8r::String& contents)
+{
+    FILE* f = fopen(file, "r");
+    if (!f) {
+        return false;
+    }
+    int c;
+    while ((c = fgetc(f)) != EOF) {
+        contents += char(c);
+    }
+    fclose(f);
+    return true;
+}
+
+m8r::String loadErrors(const Marly& marly)
+{
+    m8r::String errors;
+    for (const auto& error : *marly.parseErrors()) {
+        errors += m8r::String::format("line %d: %s\n", error._lineno, error._description.c_str());
+    }
+    return errors;
+}
+
+// Fire each element of the List in the fire var as an event. False if
+// the var isn't set yet
+bool fireEvents(Marly& marly)
+{
+    Value events = marly.global(marly.program()->atomize(options.fire.c_str()));
+    if (!events.list()) {
+        return false;
+    }
+    for (const Value& event : *events.list()) {
+        marly.fireEvent(event);
+    }
+    return true;
+}
+
+// Run until the program finishes or fails, or has run slices times.
+// Returns what it printed, followed by the runtime error if there was one
+m8r::String run(Marly& marly, uint32_t slices = 0)
+{
+    m8r::String output;
+    capture = &output;
+    bool yielded = false;
+    bool fired = options.fire.empty();
+    Marly::EventStats before = marly.eventStats();
+    for (uint32_t i = 0; !slices || i < slices; ++i) {
+        m8r::CallReturnValue result = marly.execute();
+        if (result.isError()) {
+            output += m8r::String::format("runtime error: %s\n", marly.runtimeErrorString());
+            break;
+        }
+        if (result.isFinished() || result.isDelay() || result.isWaitForEvent() ||
+                result.type() == m8r::CallReturnValue::Type::Terminated) {
+            break;
+        }
+        if (result.isYield()) {
+            yielded = true;
+            if (!fired) {
+                fired = fireEvents(marly);
+            }
+        }
+    }
+    capture = nullptr;
+    
+    if (yielded) {
+        output += "<yielded>\n";
+    }
+    
+    // Only count the events of this run
+    if (!options.fire.empty()) {
+        const Marly::EventStats& stats = marly.eventStats();
+        output += m8r::String::format("events: %d fired, %d coalesced, %d dropped, %d dispatched, %d most pending\n",
+                                      stats.fired - before.fired, stats.coalesced - before.coalesced,
+                                      stats.dropped - before.dropped, stats.dispatched - before.dispatched,
+                                      stats.maxPending);
+    }
+    return output;
+}
+
+// Run the Program of marly as options.tasks tasks of a Scheduler, each
+// with the var task set to its number. Returns what they printed,
+// followed by the slices and yields of each
+m8r::String runTasks(const m8r::SharedPtr<Marly>& marly)
+{
+    Scheduler scheduler(options.budget ? options.budget : Scheduler::DefaultSliceBudget);
+    scheduler.setSliceTime(options.sliceTime);
+    m8r::Vector<m8r::SharedPtr<Marly>> tasks;
+    for (uint32_t i = 0; i < options.tasks; ++i) {
+        m8r::SharedPtr<Marly> task = marly;
+        if (i) {
+            task = m8r::SharedPtr<Marly>(new Marly());
+            task->setProgram(marly->program());
+        }
+        task->setGlobal(marly->program()->atomize("task"), Value(int32_t(i)));
+        tasks.push_back(task);
+        scheduler.add(task);
+    }
+
+    m8r::String output;
+    capture = &output;
+    scheduler.run();
+    capture = nullptr;
+
+    for (Scheduler::TaskId id = 0; id < scheduler.taskCount(); ++id) {
+        const Scheduler::Stats& stats = scheduler.stats(id);
+        bool finished = scheduler.state(id) == Scheduler::TaskState::Finished;
+        output += m8r::String::format("task %d: %s, %d slices, %d yields\n", int32_t(id),
+                                      finished ? "finished" : "failed", stats.slices, stats.yields);
+        
+        // The Scheduler is going away
+        tasks[id]->setEventNotify(nullptr);
+    }
+    return output;
+}
+
+// Run the way the directives say
+m8r::String runScript(const m8r::SharedPtr<Marly>& marly)
+{
+    return options.tasks ? runTasks(marly) : run(*marly);
+}
+
+// Lines of the script starting with '// <directive>: '
+m8r::Vector<m8r::String> directives(const m8r::String& source, const char* directive)
+{
+    m8r::Vector<m8r::String> lines;
+    m8r::String prefix = m8r::String::format("// %s: ", directive);
+    for (const m8r::String& line : source.split("\n")) {
+        if (line.size() > prefix.size() && strncmp(line.c_str(), prefix.c_str(), prefix.size()) == 0) {
+            lines.push_back(line.c_str() + prefix.size());
+        }
+    }
+    return lines;
+}
+
+m8r::SharedPtr<Marly> newMarly()
+{
+    m8r::SharedPtr<Marly> marly(new Marly());
+    if (options.stackSize) {
+        marly->setStackSize(options.stackSize);
+    }
+    marly->setSliceBudget(options.budget);
+    marly->setSliceTime(options.sliceTime);
+    return marly;
+}
+
+// Load the script a chunk at a time, as if it were arriving as input.
+// The Scheduler only calls its idle hook, which loads the next chunk,
+// when the task is waiting, so the task must not run again until there
+// is a form for it or the load has ended
+m8r::String runIncremental(const char* file, const m8r::String& source)
+{
+    m8r::String output;
+    m8r::SharedPtr<Marly> marly = newMarly();
+    marly->startLoad(options.formSize);
+    Scheduler scheduler;
+    Scheduler::TaskId id = scheduler.add(marly);
+
+    uint32_t offset = 0;
+    uint32_t loads = 0;
+    uint32_t errors = 0;
+    scheduler.setIdle([&](int64_t) {
+        if (offset < source.size()) {
+            uint32_t size = std::min(options.chunkSize, uint32_t(source.size()) - offset);
+            m8r::StringStream stream(m8r::String(source.c_str() + offset, int32_t(size)));
+            offset += size;
+            marly->loadChunk(stream);
+            ++loads;
+            if (offset == source.size()) {
+                marly->endLoad();
+                ++loads;
+            }
+        }
+        for ( ; errors < marly->parseErrors()->size(); ++errors) {
+            const auto& error = (*marly->parseErrors())[errors];
+            output += m8r::String::format("load error: line %d: %s\n", error._lineno, error._description.c_str());
+        }
+    });
+
+    capture = &output;
+    while (scheduler.runOneIteration()) {
+        const Scheduler::Stats& stats = scheduler.stats(id);
+        if (stats.slices - stats.yields > loads + 1) {
+            fail(file, "task ran while it was waiting for input");
+            break;
+        }
+    }
+    capture = nullptr;
+    marly->setEventNotify(nullptr);
+    return output;
+}
+
+void checkNeeds(const char* file, const char* how, Marly& marly, const m8r::String& source)
+{
+    for (const m8r::String& line : directives(source, "needs")) {
+        char name[64];
+        uint32_t needs;
+        if (sscanf(line.c_str(), "%63s %u", name, &needs) != 2) {
+            fail(file, "bad needs directive", line.c_str());
+            continue;
+        }
+
+        Value value = marly.global(marly.program()->atomize(name));
+        if (!value.list()) {
+            fail(file, m8r::String::format("%s: %s is not a List", how, name).c_str());
+            continue;
+        }
+
+        // A Check has one operand, the number of values it needs
+        const Code* code = value.list()->code().get();
+        const uint8_t* pc = code->begin();
+        bool check = Code::op(pc) == Op::Check;
+        if (code->needs() != needs) {
+            fail(file, m8r::String::format("%s: %s needs %d, expected %d", how, name, code->needs(), needs).c_str());
+        } else if (check != (needs != 0)) {
+            fail(file, m8r::String::format("%s: %s %s a Check", how, name, check ? "has" : "doesn't have").c_str());
+        } else if (needs && (code->start(needs) != code->begin() + 2 || code->start(needs - 1) != code->begin())) {
+            fail(file, m8r::String::format("%s: %s doesn't skip its Check when it can", how, name).c_str());
+        }
+    }
+}
+
+void compare(const char* file, const char* how, const m8r::String& expected, const m8r::String& output)
+{
+    if (strcmp(output.c_str(), expected.c_str()) != 0) {
+        fail(file, how, "output differs");
+        printf("---- expected\n%s---- got\n%s----\n", expected.c_str(), output.c_str());
+    }
+}
+
+void testOptimizer(const char* file, const m8r::String& source, const m8r::String& expected)
+{
+    m8r::SharedPtr<Marly> marly = newMarly();
+    marly->setOptimize(true);
+    m8r::StringStream stream(source);
+    if (!marly->load(stream)) {
+        fail(file, "optimized load failed", loadErrors(*marly).c_str());
+        return;
+    }
+    compare(file, "optimized", expected, runScript(marly));
+
+    m8r::Vector<m8r::String> counts = directives(source, "optimizer");
+    if (counts.empty()) {
+        return;
+    }
+
+    // Load again, printing what the optimizer did
+    m8r::String printed;
+    marly = newMarly();
+    marly->setOptimize(true, true);
+    m8r::StringStream printStream(source);
+    capture = &printed;
+    marly->load(printStream);
+    capture = nullptr;
+
+    m8r::String expectedCounts = m8r::String::format("optimizer: %s\n", counts[0].c_str());
+    const char* line = strstr(printed.c_str(), "optimizer: ");
+    if (!line || strcmp(line, expectedCounts.c_str()) != 0) {
+        fail(file, "optimizer counts differ", line ? line : "none printed");
+        printf("---- expected\n%s", expectedCounts.c_str());
+    }
+}
+
+void testImage(const char* file, const m8r::String& source, const m8r::String& expected)
+{
+    m8r::Vector<uint8_t> image;
+    {
+        m8r::SharedPtr<Marly> marly = newMarly();
+        m8r::StringStream stream(source);
+        if (!marly->load(stream)) {
+            fail(file, "load for image failed", loadErrors(*marly).c_str());
+            return;
+        }
+        marly->program()->writeImage(image);
+    }
+    uint32_t size = uint32_t(image.size());
+
+    {
+        m8r::SharedPtr<Marly> marly = newMarly();
+        ImageStream stream(&image[0], size);
+        if (!marly->load(stream)) {
+            fail(file, "image from stream rejected", loadErrors(*marly).c_str());
+        } else {
+            compare(file, "image from stream", expected, runScript(marly));
+            checkNeeds(file, "image from stream", *marly, source);
+        }
+    }
+
+    {
+        m8r::SharedPtr<Marly> marly = newMarly();
+        if (!marly->loadImage(&image[0], size)) {
+            fail(file, "image in memory rejected", loadErrors(*marly).c_str());
+        } else {
+            compare(file, "image in memory", expected, runScript(marly));
+            checkNeeds(file, "image in memory", *marly, source);
+        }
+    }
+
+    // Damage to the header is always caught
+    struct Damage
+    {
+        const char* what;
+        uint32_t offset;
+        uint32_t size;
+    };
+
+    const Damage headerDamage[] = {
+        { "bad magic", 0, size },
+        { "bad version", 4, size },
+        { "bad opcode count", 6, size },
+        { "bad shared atoms hash", 8, size },
+        { "bad size", 12, size },
+        { "truncated", size, size - 1 },
+        { "truncated to half", size, size / 2 },
+    };
+
+    for (const Damage& damage : headerDamage) {
+        m8r::Vector<uint8_t> damaged = image;
+        if (damage.offset < size) {
+            damaged[damage.offset] ^= 0x55;
+        }
+
+        m8r::SharedPtr<Marly> marly = newMarly();
+        if (marly->loadImage(&damaged[0], damage.size)) {
+            fail(file, "damaged image in memory accepted", damage.what);
+        }
+
+        // A stream without the magic is loaded as source
+        if (damage.offset != 0) {
+            marly = newMarly();
+            ImageStream stream(&damaged[0], damage.size);
+            if (marly->load(stream)) {
+                fail(file, "damaged image from stream accepted", damage.what);
+            }
+        }
+    }
+
+    // Damage anywhere else may be caught or may just change what the
+    // program does, but the program must never crash
+    uint32_t loads = 0;
+    uint32_t rejected = 0;
+    for (uint32_t offset = ImageHeaderSize; offset < size; ++offset) {
+        for (uint8_t change : { uint8_t(0x01), uint8_t(0x80), uint8_t(0xff) }) {
+            m8r::Vector<uint8_t> damaged = image;
+            damaged[offset] ^= change;
+
+            ++loads;
+            m8r::SharedPtr<Marly> marly = newMarly();
+            if (!marly->loadImage(&damaged[0], size)) {
+                ++rejected;
+                continue;
+            }
+            marly->setSliceBudget(DamagedSliceSteps);
+            run(*marly, DamagedSlices);
+        }
+    }
+    printf("     %s: %d of %d damaged images rejected\n", file, rejected, loads);
+}
+
+void testScript(const char* file)
+{
+    m8r::String source;
+    if (!readFile(file, source)) {
+        fail(file, "can't read script");
+        return;
+    }
+
+    int failuresBefore = failures;
+
+    options = Options();
+    for (const m8r::String& line : directives(source, "stack")) {
+        options.stackSize = uint32_t(atoi(line.c_str()));
+    }
+    for (const m8r::String& line : directives(source, "chunks")) {
+        options.chunkSize = uint32_t(atoi(line.c_str()));
+    }
+    for (const m8r::String& line : directives(source, "form-size")) {
+        options.formSize = uint32_t(atoi(line.c_str()));
+    }
+    for (const m8r::String& line : directives(source, "tasks")) {
+        options.tasks = uint32_t(atoi(line.c_str()));
+    }
+    for (const m8r::String& line : directives(source, "budget")) {
+        options.budget = uint32_t(atoi(line.c_str()));
+    }
+    for (const m8r::String& line : directives(source, "slice-time")) {
+        options.sliceTime = atoi(line.c_str());
+    }
+    for (const m8r::String& line : directives(source, "fire")) {
+        options.fire = line;
+    }
+
+    // The reference run, from source and not optimized
+    m8r::String output;
+    if (options.chunkSize) {
+        output = runIncremental(file, source);
+    } else {
+        m8r::SharedPtr<Marly> marly = newMarly();
+        m8r::StringStream stream(source);
+        if (!marly->load(stream)) {
+            fail(file, "load failed", loadErrors(*marly).c_str());
+            return;
+        }
+        output = runScript(marly);
+        checkNeeds(file, "source", *marly, source);
+        
+        // Setting the Program again drops whatever was left running, so
+        // it starts over
+        marly->setProgram(marly->program());
+        m8r::String again = runScript(marly);
+        if (strcmp(again.c_str(), output.c_str()) != 0) {
+            fail(file, "run again after setProgram()", "output differs");
+            printf("---- first\n%s---- again\n%s----\n", output.c_str(), again.c_str());
+        }
+    }
+    if (output.empty()) {
+        fail(file, "script printed nothing");
+        return;
+    }
+
+    const char* suffix = strrchr(file, '.');
+    if (!suffix || strcmp(suffix, ".marly") != 0) {
+        suffix = file + strlen(file);
+    }
+    m8r::String expectedFile;
+    for (const char* p = file; p < suffix; ++p) {
+        expectedFile += *p;
+    }
+    expectedFile += ".expected";
+
+    m8r::String expected;
+    if (readFile(expectedFile.c_str(), expected)) {
+        compare(file, "source", expected, output);
+    }
+
+    // An incremental load is never optimized or made into an image
+    if (!options.chunkSize) {
+        testOptimizer(file, source, output);
+        testImage(file, source, output);
+    }
+
+    if (failures == failuresBefore) {
+        printf("PASS %s\n", file);
+    }
+}
+
+}
+
+void marly::testPrint(const char* s)
+{
+    if (capture) {
+        *capture += s;
+    } else {
+        printf("%s", s);
+    }
+}
+
+int marly::runTests(const char* const* files, int count)
+{
+    failures = 0;
+    for (int i = 0; i < count; ++i) {
+        testScript(files[i]);
+    }
+    printf("%d failure%s\n", failures, (failures == 1) ? "" : "s");
+    return failures;
+}
@@ -0,0 +1,59 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+namespace marly {
+
+// Runs each script from source and takes what it prints, including a
+// runtime error, as its output. If there is a file next to the script
+// with the same name ending in .expected instead of .marly, the output
+// must match it.
+//
+// The output must be the same when the script is run again after setting
+// its Program again, when it is optimized, and when its Program is
+// written as an image and loaded from a stream and from memory. Damaged
+// copies of the image must be rejected, or at least run without crashing.
+//
+// Lines of the script starting with '// <directive>: ' add checks or
+// change how it runs:
+//
+//      optimizer: <counts>     The line the Optimizer prints with its
+//                              counts, see Marly::setOptimize()
+//      needs: <var> <n>        The List in var needs n values, so it
+//                              starts with a Check unless n is 0, and
+//                              skips it when they are there. Checked
+//                              from source and from the image
+//      stack: <n>              Run with an operand stack of n Values
+//      chunks: <n>             Load incrementally, n bytes at a time, in
+//                              a Scheduler which loads the next chunk
+//                              when the task waits for it. Load errors
+//                              are part of the output. Not optimized or
+//                              made into an image
+//      form-size: <n>          With chunks, forms may be at most n bytes
+//      tasks: <n>              Run n tasks sharing the Program in a
+//                              Scheduler, each with the var task set to
+//                              its number. The slices and yields of each
+//                              are part of the output
+//      budget: <n>             Yield every n steps
+//      slice-time: <n>         Yield every n microseconds
+//      fire: <var>             At the first yield after var is set to a
+//                              List, fire each of its elements as an
+//                              event. The event stats are part of the
+//                              output
+//
+// '<yielded>' is added to the output if execute() ever yielded.
+//
+// Prints a line for each failure and returns the number of failures.
+int runTests(const char* const* files, int count);
+
+// Everything the scripts print goes here, so it can be captured
+void testPrint(const char*);
+
+}
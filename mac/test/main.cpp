@@ -9,12 +9,14 @@
 
 #include <iostream>
 #include <cstdlib>
+#include <cstring>
 #include <unistd.h>
 #include <stdio.h>
 
 #include "Application.h"
 #include "MacSystemInterface.h"
 #include "Marly.h"
+#include "MarlyTests.h"
 #include "MFS.h"
 
 marly::MarlyScriptingLanguage marlyScriptingLanguage;
@@ -27,8 +29,37 @@ const char* fileList[] = {
     "scripts/NetworkTime.marly"
 };
 
+const char* testList[] = {
+    "mac/test/scripts/arith.marly",
+    "mac/test/scripts/optimizer.marly",
+    "mac/test/scripts/verifier.marly",
+    "mac/test/scripts/underflow.marly",
+    "mac/test/scripts/overflow.marly",
+    "mac/test/scripts/overflow-call.marly",
+    "mac/test/scripts/image.marly",
+    "mac/test/scripts/incremental.marly",
+    "mac/test/scripts/ropes.marly",
+    "mac/test/scripts/loops.marly",
+    "mac/test/scripts/tailcall.marly",
+    "mac/test/scripts/scheduler.marly",
+    "mac/test/scripts/timeslice.marly",
+    "mac/test/scripts/events.marly",
+    "mac/test/scripts/load-errors.marly",
+    "mac/test/scripts/kernel.marly"
+};
+
 int main(int argc, char * argv[])
 {
+    // testMarly --test [scripts] runs the scripts, or all of testList,
+    // through marly::runTests()
+    if (argc > 1 && strcmp(argv[1], "--test") == 0) {
+        m8r::initMacSystemInterface("m8rFSFile", [](const char* s) { marly::testPrint(s); });
+        if (argc > 2) {
+            return marly::runTests(argv + 2, argc - 2) ? 1 : 0;
+        }
+        return marly::runTests(testList, sizeof(testList) / sizeof(const char*)) ? 1 : 0;
+    }
+
     m8r::initMacSystemInterface("m8rFSFile", [](const char* s) { ::printf("%s", s); });
     m8r::Application application;
     
@@ -3,6 +3,7 @@
 #include "GeneratedValues.h"
 #include "Defines.h"
 #include <cstdlib>
+#include <cstring>
 
 using namespace marly;
 
@@ -118,9 +119,39 @@ const char* _marly_sharedAtoms[] = {
     _while$,
 };
 
+// Index in _marly_sharedAtoms of the string hashing to each slot, 0xffff if none
+static const uint16_t _marly_sharedAtomHash[256] = {
+    45, 8, 0xffff, 15, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff,
+    17, 0xffff, 10, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 3, 0xffff, 52, 0xffff, 0xffff, 0xffff, 0xffff,
+    43, 31, 0xffff, 34, 0xffff, 35, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0, 0xffff, 6, 0xffff,
+    7, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 42, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff,
+    51, 24, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 19, 11, 0xffff, 0xffff, 0xffff,
+    0xffff, 0xffff, 22, 0xffff, 0xffff, 0xffff, 0xffff, 5, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 49, 0xffff, 14,
+    12, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 13, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff,
+    0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 53, 0xffff, 0xffff, 36, 0xffff, 0xffff, 0xffff, 0xffff, 25, 0xffff,
+    0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 47, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 16, 28, 0xffff, 0xffff, 0xffff,
+    0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 39, 0xffff, 0xffff, 0xffff, 0xffff, 26, 0xffff,
+    0xffff, 0xffff, 40, 0xffff, 0xffff, 0xffff, 0xffff, 4, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff,
+    30, 0xffff, 1, 0xffff, 20, 0xffff, 0xffff, 0xffff, 23, 0xffff, 0xffff, 0xffff, 41, 0xffff, 18, 0xffff,
+    0xffff, 0xffff, 32, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 38, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff,
+    0xffff, 0xffff, 0xffff, 0xffff, 37, 0xffff, 50, 0xffff, 0xffff, 0xffff, 2, 0xffff, 0xffff, 0xffff, 46, 21,
+    0xffff, 27, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 33, 0xffff, 0xffff,
+    0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 48, 44, 0xffff, 0xffff, 0xffff, 0xffff, 0xffff, 9, 29,
+};
+
 const char** marly::sharedAtoms(uint16_t& nelts)
 {
     nelts = sizeof(_marly_sharedAtoms) / sizeof(const char*);
     return _marly_sharedAtoms;
 }
 
+int32_t marly::findSharedAtom(const char* s)
+{
+    uint32_t hash = 2166136301u;
+    for (const char* p = s; *p; ++p) {
+        hash = (hash ^ uint8_t(*p)) * 16777619u;
+    }
+    uint16_t index = _marly_sharedAtomHash[hash & 255u];
+    return (index != 0xffff && strcmp(_marly_sharedAtoms[index], s) == 0) ? index : -1;
+}
+
@@ -65,6 +65,10 @@ enum class SA : uint16_t {
 };
 
 const char** sharedAtoms(uint16_t& nelts);
+
+// Index of s in sharedAtoms(), or -1 if it isn't a shared atom. No search
+int32_t findSharedAtom(const char* s);
+
 const char* specialChars();
 static inline m8r::Atom SAtom(SA sa) { return m8r::Atom(static_cast<m8r::Atom::value_type>(sa)); }
 
@@ -9,9 +9,13 @@
 
 #include "Marly.h"
 
+#include "MarlyOptimizer.h"
 #include "Timer.h"
 #include "SystemTime.h"
 
+#include <algorithm>
+#include <limits>
+
 using namespace marly;
 
 m8r::SharedPtr<m8r::Executable> MarlyScriptingLanguage::create() const
@@ -37,75 +41,356 @@ static Value timerStart(Marly* marly, const Value& value)
         return Value();
     }
     
-    timer->setCallback([marly, body](m8r::Timer*) { marly->fireEvent(body); });
+    // The body may be part of the Program, which is kept until the Timer
+    // is done with it. It only runs in that Program
+    m8r::SharedPtr<Program> program = marly->program();
+    timer->setCallback([marly, body, program](m8r::Timer*) {
+        if (marly->program().get() == program.get()) {
+            marly->fireEvent(body);
+        }
+    });
     timer->start(duration, repeat ? m8r::Timer::Behavior::Repeating : m8r::Timer::Behavior::Once);
     return Value();
 }
 
 Marly::Marly()
+    : _program(new Program())
 {
-    uint16_t count = 0;
-    const char** list = sharedAtoms(count);
-    _atomTable.setSharedAtomList(list, count);
-    
     // Add global vars
-    m8r::SharedPtr<Map> timer(new Map());
+    Map* timer = new Map();
+    setGlobal(SAtom(SA::Timer), timer);
     timer->emplace(SAtom(SA::Once), 0);
     timer->emplace(SAtom(SA::Repeat), 1);
     timer->emplace(SAtom(SA::start), Value(timerStart));
     timer->emplace(SAtom(SA::stop), 1);
-    _vars.emplace(SAtom(SA::Timer), timer);
+}
+
+namespace {
+
+// Source whose first few chars were read to check for an image
+class PrefixStream : public m8r::Stream
+{
+public:
+    PrefixStream(const uint8_t* prefix, uint8_t size, const m8r::Stream& stream) : _prefix(prefix), _size(size), _stream(stream) { }
+    
+    virtual bool eof() const override { return _index >= _size && _stream.eof(); }
+    virtual int read() const override { return (_index < _size) ? _prefix[_index++] : _stream.read(); }
+    virtual int write(uint8_t) override { return -1; }
+
+private:
+    const uint8_t* _prefix;
+    uint8_t _size;
+    mutable uint8_t _index = 0;
+    const m8r::Stream& _stream;
+};
+
 }
 
 bool Marly::load(const m8r::Stream& stream)
 {
+    // A stream starting with the image magic is a Program image
+    uint8_t magic[Program::ImageMagicSize];
+    uint8_t magicSize = 0;
+    while (magicSize < Program::ImageMagicSize && !stream.eof()) {
+        int c = stream.read();
+        if (c < 0) {
+            break;
+        }
+        magic[magicSize++] = uint8_t(c);
+    }
+    
+    if (magicSize == Program::ImageMagicSize && Program::isImageMagic(magic)) {
+        m8r::SharedPtr<Program> program(new Program());
+        return setImageProgram(program, program->readImage(magic, stream));
+    }
+    
+    setProgram(m8r::SharedPtr<Program>(new Program()));
+    _loading = false;
+    _lineOffset = 0;
+    _parseStack.push(Value(new List()));
+    
+    PrefixStream source(magic, magicSize, stream);
+    if (!parse(source)) {
+        return false;
+    }
+    
+    if (_optimize) {
+        Optimizer optimizer(*_program);
+        optimizer.optimize(_parseStack.top());
+        if (_printOptimized) {
+            const Optimizer::Stats& stats = optimizer.stats();
+            print(Optimizer::toString(*_program, _parseStack.top()).c_str());
+            print(m8r::String::format("optimizer: %d folded, %d branches removed, %d inlined\n",
+                                      stats.folded, stats.branches, stats.inlined).c_str());
+        }
+    }
+    
+    _program->finish(_parseStack.top());
+    _parseStack.pop();
+    _stringLiterals.clear();
+    setProgram(_program);
+    
+    // The program starts with an empty stack
+    uint8_t needs = _program->root().list()->code()->needs();
+    if (needs) {
+        _parseErrors.emplace_back(m8r::String::format("stack underflow, program needs %d at the start", needs).c_str(), 0);
+    }
+    return _parseErrors.size() == 0;
+}
+
+void Marly::startLoad(uint32_t maxFormSize)
+{
+    // The root of the Program is empty, each form is run on its own
+    setProgram(m8r::SharedPtr<Program>(new Program()));
+    _program->finish(Value(new List()));
+    _loading = true;
+    _lineOffset = 0;
+    _lineCount = 0;
+    _maxFormSize = maxFormSize;
+    _formText.clear();
+    _formDepth = 0;
+    _textState = TextState::Code;
+    _skipForm = false;
+}
+
+bool Marly::loadChunk(const m8r::Stream& stream)
+{
+    assert(_loading);
+    
+    size_t forms = _forms.size();
+    bool success = true;
+    while (!stream.eof()) {
+        int c = stream.read();
+        if (c < 0) {
+            break;
+        }
+        
+        if (_formText.empty()) {
+            _lineOffset = _lineCount;
+        }
+        
+        // Comments aren't kept or counted against the size of the form.
+        // Their newlines are, so errors are reported on the right line,
+        // and a space where a block comment ends in case it separates two
+        // tokens. The '/' which started the comment is taken back off
+        TextState state = _textState;
+        bool endOfForm = scanForEndOfForm(char(c));
+        if (isComment(state) && c != '\n') {
+            c = (_textState == TextState::Code) ? ' ' : 0;
+        } else if (state == TextState::Slash && isComment(_textState)) {
+            if (!_skipForm && !_formText.empty()) {
+                _formText = m8r::String(_formText.c_str(), int32_t(_formText.size()) - 1);
+            }
+            c = 0;
+        }
+        
+        if (!_skipForm && c) {
+            if (_formText.size() >= _maxFormSize) {
+                _parseErrors.emplace_back(m8r::String::format("form longer than %d bytes", int32_t(_maxFormSize)).c_str(), _lineOffset + 1);
+                _formText.clear();
+                _skipForm = true;
+                success = false;
+            } else {
+                _formText += char(c);
+            }
+        }
+        
+        if (c == '\n') {
+            _lineCount++;
+        }
+        if (endOfForm) {
+            if (_skipForm) {
+                _skipForm = false;
+            } else if (!parseForm()) {
+                success = false;
+            }
+        }
+    }
+    if (_forms.size() != forms && _eventNotify) {
+        _eventNotify();
+    }
+    return success;
+}
+
+bool Marly::endLoad()
+{
+    assert(_loading);
+    
+    // The last form might not end with a newline
+    bool success = true;
+    if (_textState == TextState::Code || _textState == TextState::LineComment) {
+        if (_formDepth == 0 && !_skipForm) {
+            success = parseForm();
+        }
+    }
+    if (_formDepth != 0 || (_textState != TextState::Code && _textState != TextState::LineComment)) {
+        // Reported on the line where the unfinished form starts
+        _parseErrors.emplace_back("unexpected end of script", _lineOffset + 1);
+        success = false;
+    }
+    
+    _loading = false;
+    _formText.clear();
+    if (_eventNotify) {
+        _eventNotify();
+    }
+    return success;
+}
+
+bool Marly::scanForEndOfForm(char c)
+{
+    // Just enough of the syntax to find the newline at the end of a form
+    switch (_textState) {
+        case TextState::Slash:
+            if (c == '/') {
+                _textState = TextState::LineComment;
+                return false;
+            }
+            if (c == '*') {
+                _textState = TextState::BlockComment;
+                return false;
+            }
+            _textState = TextState::Code;
+            return scanForEndOfForm(c);
+        case TextState::Code:
+            switch (c) {
+                case '[': _formDepth++; break;
+                case ']': if (_formDepth) _formDepth--; break;
+                case '"':
+                case '\'':
+                    _quote = c;
+                    _textState = TextState::String;
+                    break;
+                case '/': _textState = TextState::Slash; break;
+                case '\n': return _formDepth == 0;
+                default: break;
+            }
+            return false;
+        case TextState::LineComment:
+            if (c == '\n') {
+                _textState = TextState::Code;
+                return _formDepth == 0;
+            }
+            return false;
+        case TextState::BlockComment:
+            if (c == '*') {
+                _textState = TextState::BlockCommentStar;
+            }
+            return false;
+        case TextState::BlockCommentStar:
+            if (c == '/') {
+                _textState = TextState::Code;
+            } else if (c != '*') {
+                _textState = TextState::BlockComment;
+            }
+            return false;
+        case TextState::String:
+            if (c == '\\') {
+                _textState = TextState::StringEscape;
+            } else if (c == _quote) {
+                _textState = TextState::Code;
+            }
+            return false;
+        case TextState::StringEscape:
+            _textState = TextState::String;
+            return false;
+    }
+    return false;
+}
+
+bool Marly::parseForm()
+{
+    m8r::StringStream stream(_formText);
+    _formText.clear();
+    
+    uint16_t firstGlobal = _program->globalCount();
+    _parseStack.push(Value(new List()));
+    bool success = parse(stream);
+    _stringLiterals.clear();
+    
+    if (success) {
+        if (!_parseStack.top().list()->empty()) {
+            _forms.push_back(_parseStack.top());
+        }
+        _parseStack.pop();
+    }
+    
+    // Vars first used in this form get slots
+    _globals.resize(_program->globalCount());
+    bindHostGlobals(firstGlobal);
+    return success;
+}
+
+void Marly::pushForm()
+{
+    _frames.push(Frame(_forms[0].list(), State::Function));
+    _forms.erase(_forms.begin());
+}
+
+bool Marly::parse(const m8r::Stream& stream)
+{
+    // Parse stream into the List on top of _parseStack. On success it is
+    // left there. On failure _parseStack is emptied
+    uint32_t parseDepth = _parseStack.size();
+    uint32_t errors = _parseErrors.size();
     _scanner.setStream(&stream);
-    _codeStack.push(m8r::SharedPtr<List>(new List()));
     
     while (true) {
         m8r::Token token = _scanner.getToken();
         switch (token) {
             case m8r::Token::True:
             case m8r::Token::False:
-                _codeStack.top().push_back(token == m8r::Token::True);
+                _parseStack.top().push_back(token == m8r::Token::True);
                 break;
             case m8r::Token::String:
-                _codeStack.top().push_back(_scanner.getTokenValue().str);
+                _parseStack.top().push_back(stringLiteral(_scanner.getTokenValue().str));
                 break;
             case m8r::Token::Integer:
-                _codeStack.top().push_back(int32_t(_scanner.getTokenValue().integer));
+                _parseStack.top().push_back(int32_t(_scanner.getTokenValue().integer));
+                break;
+            case m8r::Token::Float:
+                _parseStack.top().push_back(float(_scanner.getTokenValue().number));
                 break;
             case m8r::Token::Identifier: {
                 // If the Atom ID is less than ExternalAtomOffset then
                 // it is built in and there is a corresponding verb with
                 // that same id
-                m8r::Atom atom = _atomTable.atomizeString(_scanner.getTokenValue().str);
+                m8r::Atom atom = _program->atomize(_scanner.getTokenValue().str);
                 if (atom.raw() < m8r::ExternalAtomOffset) {
-                    _codeStack.top().push_back(static_cast<Value::Type>(atom.raw()));
+                    _parseStack.top().push_back(static_cast<Value::Type>(atom.raw()));
                     break;
                 }
                 
                 // Try to find the id in the list of verbs
                 auto it1 = _verbs.find(atom);
                 if (it1 != _verbs.end()) {
-                    _codeStack.top().push_back(Value(int32_t(it1 - _verbs.begin()), Value::Type::Verb));
+                    _parseStack.top().push_back(Value(int32_t(it1 - _verbs.begin()), Value::Type::Verb));
                     break;
                 }
                 
                 if (addParseError(m8r::String::format("invalid identifier '%s'", _scanner.getTokenValue().str).c_str())) {
+                    _parseStack.pop(_parseStack.size());
                     return false;
                 }
                 break;
             }
             case m8r::Token::LBracket:
-                _codeStack.push(m8r::SharedPtr<List>(new List()));
+                _parseStack.push(Value(new List()));
                 break;
             case m8r::Token::RBracket: {
+                if (_parseStack.size() <= parseDepth) {
+                    if (addParseError("unexpected ']'")) {
+                        _parseStack.pop(_parseStack.size());
+                        return false;
+                    }
+                    break;
+                }
+                
                 // When closing a list, write a command to push it onto the stack
-                assert(_codeStack.top().type() == Value::Type::List);
-                Value list = _codeStack.top();
-                _codeStack.pop();
-                _codeStack.top().push_back(list);
+                assert(_parseStack.top().type() == Value::Type::List);
+                Value list = _parseStack.top();
+                _parseStack.pop();
+                _parseStack.top().push_back(list);
                 break;
             }
             case m8r::Token::Dollar:    // Load var
@@ -120,12 +405,27 @@ bool Marly::load(const m8r::Stream& stream)
                 m8r::Token idToken = _scanner.getToken();
                 if (idToken != m8r::Token::Identifier) {
                     if (addParseError("identifier required")) {
+                        _parseStack.pop(_parseStack.size());
                         return false;
                     }
                     break;
                 }
                 
-                m8r::Atom atom = _atomTable.atomizeString(_scanner.getTokenValue().str);
+                m8r::Atom atom = _program->atomize(_scanner.getTokenValue().str);
+                
+                // Vars are bound to their slot here so access is just an index
+                int32_t operand = atom.raw();
+                if (token == m8r::Token::Dollar || token == m8r::Token::At || token == m8r::Token::Twiddle) {
+                    uint16_t slot;
+                    if (!_program->findGlobal(atom, slot) && _program->globalCount() == MaxGlobals) {
+                        if (addParseError("too many vars")) {
+                            _parseStack.pop(_parseStack.size());
+                            return false;
+                        }
+                        break;
+                    }
+                    operand = _program->addGlobal(atom);
+                }
                 
                 Value::Type type;
                 switch (token) {
@@ -138,418 +438,1210 @@ bool Marly::load(const m8r::Stream& stream)
                     default: assert(0); return false;
                     
                 }
-                _codeStack.top().push_back(Value(atom.raw(), type));
+                _parseStack.top().push_back(Value(operand, type));
                 break;
             }
             case m8r::Token::EndOfFile:
-                if (_codeStack.size() != 1) {
-                    if (addParseError("misaligned code stack")) {
-                        return false;
-                    }
+                if (_parseStack.size() != parseDepth) {
+                    addParseError("misaligned code stack");
                 }
-                return _parseErrors.size() == 0;
+                if (_parseErrors.size() != errors) {
+                    _parseStack.pop(_parseStack.size());
+                    return false;
+                }
+                return true;
             default:
                 // Assume any other token is a built-in verb
-                _codeStack.top().push_back(Value(int(token), Value::Type::TokenVerb));
+                _parseStack.top().push_back(Value(int(token), Value::Type::TokenVerb));
                 break;
         }
         _scanner.retireToken();
     }
 }
 
-m8r::CallReturnValue Marly::execute()
+// The interpreter loop dispatches either through a switch or, when
+// MARLY_COMPUTED_GOTO is set, by jumping through a table of label
+// addresses at the end of every instruction. The latter gives each
+// opcode its own indirect branch, which predicts much better. It
+// needs the GCC labels-as-values extension, so it defaults to on
+// for GCC and clang only.
+//
+// Other compilers get the switch rather than a table of handler
+// functions. C++14 has no guaranteed tail call, so each handler would
+// return to a loop, which is the same shared indirect branch as the
+// switch. It would also have to keep _pc and the current Code in
+// memory, where the switch keeps them in registers.
+#ifndef MARLY_COMPUTED_GOTO
+#if defined(__GNUC__)
+#define MARLY_COMPUTED_GOTO 1
+#else
+#define MARLY_COMPUTED_GOTO 0
+#endif
+#endif
+
+// Build with MARLY_PROFILE to count the opcode pairs and triples executed.
+// The most frequent are printed when the program finishes, as candidates
+// for new superinstructions.
+#ifdef MARLY_PROFILE
+#define PROFILE() profileOp(op)
+#else
+#define PROFILE()
+#endif
+
+// A computed goto out of a block does not run the destructors of its locals,
+// so a handler with locals must close its block before NEXT().
+#if MARLY_COMPUTED_GOTO
+#define OPCODE(name) L_##name
+#define DISPATCH() do { op = _currentCode->op(_pc); PROFILE(); goto *dispatchTable[uint8_t(op)]; } while (0)
+#define NEXT() DISPATCH()
+#else
+#define OPCODE(name) case Op::name
+#define NEXT() continue
+#endif
+
+// Calls and loop iterations are the only way execution can go on
+// indefinitely. They are the safe points where pending events are
+// dispatched and the slice budget is checked. When it runs out save the
+// frame and yield.
+#define SAFE_POINT() do { \
+    if (_eventCount && !_inEvent) { \
+        dispatchEvent(); \
+    } \
+    if (--_budgetLeft == 0 && sliceExpired()) { \
+        saveFrame(); \
+        return m8r::CallReturnValue(m8r::CallReturnValue::Type::Yield); \
+    } \
+} while (0)
+
+// An opaque instruction which doesn't call anything, or returns without
+// going through End, goes on with the rest of the current run. The stack
+// may be deeper than when the run started, so make sure there is still
+// room for what it pushes
+#define ROOM_CHECK() do { \
+    if (!hasRoom(_currentCode)) { \
+        return stackOverflow(); \
+    } \
+} while (0)
+
+Value Marly::stringLiteral(const char* s)
 {
-    enum class Action { None, Break, Continue, Return };
-    Action action = Action::None;
+    // FNV-1a. Look it up before making a Value, so a repeated literal
+    // doesn't allocate. Only Strings too long to be stored inline are in
+    // the table. On a collision with a different string just don't
+    // intern it
+    uint32_t hash = 2166136261u;
+    for (const char* p = s; *p; ++p) {
+        hash = (hash ^ uint8_t(*p)) * 16777619u;
+    }
+    
+    auto it = _stringLiterals.find(hash);
+    if (it != _stringLiterals.end() && strcmp(it->value.string()->string().c_str(), s) == 0) {
+        return it->value;
+    }
     
-    // If there is only one element on the _codeStack it is the outermost list and we
-    // are just starting the program
-    assert(_codeStack.size() > 0);
-    if (_codeStack.size() == 1) {
-        _codeStack.push(0);
-        _codeStack.push(int32_t(State::Function));
+    Value value(s);
+    if (!value.isShortString() && it == _stringLiterals.end()) {
+        _stringLiterals.emplace(hash, value);
     }
-    assert(_codeStack.size() >= 3);
+    return value;
+}
 
-    startExec();
+void Marly::printMemoryStats() const
+{
+    print("Pool          size   live   peak  chunks  free%  allocs\n");
+    Pool::forEach([this](const Pool& pool) {
+        const Pool::Stats& stats = pool.stats();
+        print(m8r::String::format("%-12s %5d %6d %6d %7d %5d%% %7d\n", pool.name(), int32_t(pool.blockSize()),
+                                  int32_t(stats.live), int32_t(stats.peakLive), int32_t(stats.chunks),
+                                  pool.fragmentation(), int32_t(stats.allocations)).c_str());
+    });
+}
+
+void Marly::setProgram(const m8r::SharedPtr<Program>& program)
+{
+    // Nothing may be left which refers to the old Program, which can be
+    // deleted now. Check the host vars while it is still here
+    m8r::SharedPtr<Program> old = _program;
+    _program = program;
+    for (auto it = _hostGlobals.begin(); it != _hostGlobals.end(); ) {
+        if (_program->canUse(it->value)) {
+            ++it;
+        } else {
+            _hostGlobals.erase(it);
+        }
+    }
     
-    while (true) {
-        bool brk = false;
-        if (action != Action::None) {
-            if (action == Action::Break) {
-                // break out of current loop
-                if (_currentState == State::Function) {
-                    _errorString = "cannot 'break' out of function";
-                    return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
-                }
-                
-                brk = true;
-                if (_currentState == State::LoopBody) {
-                    action = Action::None;
-                }
-            }
+    _stack.pop(_stack.size());
+    _frames.pop(_frames.size());
+    _loops.pop(_loops.size());
+    for (Value& event : _events) {
+        event = Value();
+    }
+    _eventHead = 0;
+    _eventCount = 0;
+    _inEvent = false;
+    _delayEnd = 0;
+    
+    _globals.clear();
+    _globals.resize(_program->globalCount());
+    _forms.clear();
+    bindHostGlobals(0);
+}
+
+void Marly::bindHostGlobals(uint16_t first)
+{
+    // Vars set by the host before the program was set go into their slots
+    for (const auto& it : _hostGlobals) {
+        uint16_t slot;
+        if (_program->findGlobal(it.key, slot) && slot >= first) {
+            _globals[slot] = it.value;
         }
-        
-        if (brk || _currentIndex >= _currentCode->size()) {
-            if (!brk && _currentState == State::LoopBody) {
-                // loop again
-                _currentIndex = 0;
-                continue;
-            }
-            
-            // Done with the current function. pop it
-            _codeStack.pop(3);
-            if (_codeStack.size() == 0) {
-                return m8r::CallReturnValue(m8r::CallReturnValue::Type::Finished);
+    }
+}
+
+Value Marly::global(m8r::Atom name) const
+{
+    uint16_t slot;
+    if (_program->findGlobal(name, slot)) {
+        return _globals[slot];
+    }
+    auto it = _hostGlobals.find(name);
+    return (it == _hostGlobals.end()) ? Value() : it->value;
+}
+
+bool Marly::setGlobal(m8r::Atom name, const Value& value)
+{
+    if (!_program->canUse(value)) {
+        return false;
+    }
+    
+    uint16_t slot;
+    if (_program->findGlobal(name, slot)) {
+        _globals[slot] = value;
+        return true;
+    }
+    auto it = _hostGlobals.find(name);
+    if (it == _hostGlobals.end()) {
+        _hostGlobals.emplace(name, value);
+    } else {
+        it->value = value;
+    }
+    return true;
+}
+
+bool Marly::loadImage(const uint8_t* image, uint32_t size)
+{
+    m8r::SharedPtr<Program> program(new Program());
+    return setImageProgram(program, program->readImage(image, size));
+}
+
+bool Marly::setImageProgram(const m8r::SharedPtr<Program>& program, const char* error)
+{
+    if (error) {
+        _parseErrors.emplace_back(error, 0);
+        return false;
+    }
+    setProgram(program);
+    return true;
+}
+
+m8r::CallReturnValue Marly::varNotFound(uint16_t slot)
+{
+    _errorString = m8r::String::format("var '%s' not found", stringFromAtom(_program->globalName(slot)));
+    return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
+}
+
+m8r::CallReturnValue Marly::stackUnderflow(uint32_t needed)
+{
+    _errorString = m8r::String::format("stack underflow, needs %d", needed);
+    return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
+}
+
+m8r::CallReturnValue Marly::stackOverflow()
+{
+    _errorString = m8r::String::format("stack overflow, size is %d", _stack.capacity());
+    return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
+}
+
+m8r::CallReturnValue Marly::execute()
+{
+    // If there are no frames we are just starting the program, otherwise
+    // continue where it left off
+    if (_frames.empty()) {
+        if (!_forms.empty()) {
+            pushForm();
+        } else if (!_loading) {
+            assert(_program->root().type() == Value::Type::List);
+            _frames.push(Frame(_program->root().list(), State::Function));
+        } else if (_eventCount) {
+            // Waiting for the next form. Events still run
+            dispatchEvent();
+            if (_frames.empty()) {
+                return m8r::CallReturnValue(m8r::CallReturnValue::Type::WaitForEvent);
             }
-            assert(_codeStack.size() >= 3);
-            startExec();
-            continue;
+        } else {
+            return m8r::CallReturnValue(m8r::CallReturnValue::Type::WaitForEvent);
         }
+    }
+    loadFrame();
+    if (!hasRoom(_currentCode)) {
+        return stackOverflow();
+    }
+    startSlice();
+    
+    // Run pending events first. If there are none and this was called
+    // before the end of a delay go back to waiting
+    if (!_inEvent) {
+        if (_eventCount) {
+            dispatchEvent();
+        } else if (resumeDelay()) {
+            return m8r::CallReturnValue(m8r::CallReturnValue::Type::Delay);
+        }
+    }
+    
+    Op op;
+    
+#if MARLY_COMPUTED_GOTO
+    static const void* const dispatchTable[] = {
+#define MARLY_OP_LABEL(name) &&L_##name,
+        MARLY_OPS(MARLY_OP_LABEL)
+#undef MARLY_OP_LABEL
+    };
+    static_assert(sizeof(dispatchTable) / sizeof(void*) == size_t(Op::Count), "dispatch table out of sync with Op");
 
-        Value it = (*_currentCode)[_currentIndex++];
-        
-        switch(it.type()) {
-            case Value::Type::Int: _stack.push(it.integer()); break;
-            case Value::Type::String:
-                if (it.type() == Value::Type::String) {
-                    _stack.push(it.string());
-                } else {
-                    String s;
-                    it.toString(s);
-                    _stack.push(s.string().c_str());
-                }
-                break;
-            case Value::Type::List: _stack.push(it.list()); break;
-            case Value::Type::Load: {
-                auto foundValue = _vars.find(m8r::Atom(it.integer()));
-                if (foundValue == _vars.end()) {
-                    _errorString = "var not found";
-                    return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
+    DISPATCH();
+    {
+#else
+    while (true) {
+        op = _currentCode->op(_pc);
+        PROFILE();
+        switch(op) {
+#endif
+            OPCODE(PushFalse): _stack.push(false); NEXT();
+            OPCODE(PushTrue): _stack.push(true); NEXT();
+            OPCODE(PushInt8): _stack.push(int32_t(_currentCode->int8(_pc))); NEXT();
+            OPCODE(PushConst): _stack.push(_currentCode->constant(_currentCode->uint8(_pc))); NEXT();
+            OPCODE(PushConstWide): _stack.push(_currentCode->constant(_currentCode->uint16(_pc))); NEXT();
+            OPCODE(Load): {
+                uint16_t slot = _currentCode->uint16(_pc);
+                if (_globals[slot].type() == Value::Type::Undefined) {
+                    return varNotFound(slot);
                 }
-                _stack.push(foundValue->value);
-                break;
+                _stack.push(_globals[slot]);
             }
-            case Value::Type::Store:
-                _vars.emplace(m8r::Atom(it.integer()), _stack.top());
+            NEXT();
+            OPCODE(Store): {
+                // A List literal is part of the Program. The var gets its
+                // own copy so changing it doesn't change the Program
+                Value& var = _globals[_currentCode->uint16(_pc)];
+                if (_stack.top().type() == Value::Type::List && _stack.top().isFrozen()) {
+                    var = Value(_stack.top().list()->clone());
+                } else {
+                    var = std::move(_stack.top());
+                }
                 _stack.pop();
-                break;
-            case Value::Type::Exec: {
-                auto foundValue = _vars.find(m8r::Atom(it.integer()));
-                if (foundValue == _vars.end()) {
-                    _errorString = "var not found";
-                    return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
+            }
+            NEXT();
+            OPCODE(Exec): {
+                uint16_t slot = _currentCode->uint16(_pc);
+                if (_globals[slot].type() == Value::Type::Undefined) {
+                    return varNotFound(slot);
                 }
                 
-                if (!initExec(foundValue->value)) {
+                if (!pushFrame(_globals[slot])) {
                     return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
                 }
-                startExec();
-                
-                break;
+                SAFE_POINT();
             }
-            case Value::Type::LoadProp: {
-                // push the value for the property identified by Atom(it.integer())
+            NEXT();
+            OPCODE(LoadProp): {
+                // push the value for the property identified by the Atom operand
                 // of the Map on TOS
+                m8r::Atom prop(_currentCode->uint16(_pc));
                 Value val = _stack.top();
                 _stack.pop();
-                _stack.push(val.property(m8r::Atom(it.integer())));
-                break;
+                _stack.push(val.property(prop));
             }
-            case Value::Type::StoreProp: {
-                // Store the value in TOS-1 in the property identified by Atom(it.integer())
+            NEXT();
+            OPCODE(StoreProp): {
+                // Store the value in TOS-1 in the property identified by the Atom operand
                 // in the Map on TOS
+                m8r::Atom prop(_currentCode->uint16(_pc));
                 Value val = _stack.top();
+                if (val.type() == Value::Type::List && val.isFrozen()) {
+                    _errorString = "cannot change a List literal, store it in a var first";
+                    return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
+                }
                 _stack.pop();
-                val.setProperty(m8r::Atom(it.integer()), _stack.top());
+                val.setProperty(prop, _stack.top());
                 _stack.pop();
-                break;
             }
-            case Value::Type::ExecProp: {
+            NEXT();
+            OPCODE(ExecProp): {
                 // Load obj on TOS, find prop in it and exec, push returned value
                 // FIXME: For now the property must be a native function. Need to
                 // support List to be executed as a nested body
+                m8r::Atom prop(_currentCode->uint16(_pc));
                 Value val = _stack.top();
                 _stack.pop();
-                _stack.push(val.callProperty(m8r::Atom(it.integer())));
-                break;
+                _stack.push(val.callProperty(prop));
             }
-            case Value::Type::Verb:
-                _verbs[it.integer()].value();
-                break;
+            NEXT();
+            OPCODE(CallVerb): {
+                // Verbs are registered with each Marly, so a Program from an
+                // image or another Marly can have an index past the end
+                uint16_t verb = _currentCode->uint16(_pc);
+                if (verb >= _verbs.size()) {
+                    _errorString = m8r::String::format("verb %d is not registered", verb);
+                    return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
+                }
+                _verbs[verb].value();
+            }
+            ROOM_CHECK();
+            NEXT();
                 
-            case Value::Type::TokenVerb: {
-                switch(static_cast<m8r::Token>(it.integer())) {
-                    case m8r::Token::Plus:
-                    case m8r::Token::Minus:
-                    case m8r::Token::Star:
-                    case m8r::Token::Slash:
-                    case m8r::Token::Percent: {
-                        float rhs = _stack.top().flt();
-                        _stack.pop();
-                        float lhs = _stack.top().flt();
-                        _stack.pop();
-                        float result = 0;
-                        switch(static_cast<m8r::Token>(it.integer())) {
-                            case m8r::Token::Plus: result = lhs + rhs; break;
-                            case m8r::Token::Minus: result = lhs - rhs; break;
-                            case m8r::Token::Star: result = lhs * rhs; break;
-                            case m8r::Token::Slash: result = lhs / rhs; break;
-                            default: break;
-                        }
-                        _stack.push(result);
-                        break;
-                    }
-                    default: {
-                        _errorString = "unrecognized verb '";
-                        _errorString += char(it.integer());
-                        _errorString += "'";
+            OPCODE(Add):
+            OPCODE(Sub):
+            OPCODE(Mul):
+            OPCODE(Div):
+            OPCODE(Mod): {
+                const Value& rhs = _stack.top();
+                const Value& lhs = _stack.top(-1);
+                Value result;
+                if (lhs.type() == Value::Type::Int && rhs.type() == Value::Type::Int) {
+                    int32_t i;
+                    if (!intArith(op, lhs.integer(), rhs.integer(), i)) {
+                        _errorString = "integer divide by zero";
                         return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
                     }
+                    result = Value(i);
+                } else {
+                    result = Value(floatArith(op, lhs.flt(), rhs.flt()));
                 }
-                break;
+                _stack.pop();
+                _stack.top() = result;
             }
-            
-            // Handle built-in verbs
-            default: {
-                // If the Type is < ExternalAtomOffset this is a built-in verb
-                if (!it.isBuiltInVerb()) {
-                    _errorString = "unrecognized value";
+            NEXT();
+            OPCODE(Dup):
+                _stack.push(_stack.top());
+                NEXT();
+            OPCODE(Swap):
+                _stack.top().swap(_stack.top(-1));
+                NEXT();
+            OPCODE(Pick):
+            OPCODE(Tuck): {
+                int32_t i = _stack.top().integer();
+                _stack.pop();
+                if (i < 0 || i >= int32_t(_stack.size())) {
+                    _errorString = m8r::String::format("%s index %d out of range", (op == Op::Pick) ? "pick" : "tuck", i);
                     return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
                 }
                 
-                switch(it.builtInVerb()) {
-                    case SA::dup:
-                        _stack.push(_stack.top());
-                        break;
-                    case SA::swap: {
-                        Value v1 = _stack.top();
-                        _stack.pop();
-                        Value v2 = _stack.top();
-                        _stack.pop();
-                        _stack.push(v1);
-                        _stack.push(v2);
-                        break;
-                    }
-                    case SA::at:
-                    case SA::atput:
-                    case SA::insert: {
-                        int32_t i = _stack.top().integer();
-                        _stack.pop();
-
-                        Value v;
-                        if (it.builtInVerb() != SA::at) {
-                            v = _stack.top();
-                            _stack.pop();
-                        }
-                        
-                        // Make sure TOS is a List
-                        m8r::SharedPtr<List> list = _stack.top().list();
-                        _stack.pop();
-                        if (!list) {
-                            _errorString = "target must be List for 'insert'";
-                            return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
-                        }
-                        
-                        if (it.builtInVerb() == SA::insert) {
-                            if (i > list->size()) {
-                                i = int32_t(list->size());
-                            }
-                            list->insert(list->begin() + i, v);
-                        } else {
-                            if (i >= list->size()) {
-                                _errorString = m8r::String::format("at index %d out of range for list of size %d", i, list->size());
-                                return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
-                             }
-                        
-                            if (it.builtInVerb() == SA::at) {
-                                _stack.push((*list)[i]);
-                            } else {
-                                (*list)[i] = v;
-                            }
-                        }
-                        break;
+                // Rotate the top i + 1 items, moving not copying
+                Value* first = &_stack.top(-i);
+                Value* last = &_stack.top() + 1;
+                if (op == Op::Pick) {
+                    std::rotate(first, first + 1, last);
+                } else {
+                    std::rotate(first, last - 1, last);
+                }
+            }
+            NEXT();
+            OPCODE(Pop):
+                _stack.pop();
+                NEXT();
+            OPCODE(At):
+            OPCODE(AtPut):
+            OPCODE(Insert): {
+                int32_t i = _stack.top().integer();
+                _stack.pop();
+
+                Value v;
+                if (op != Op::At) {
+                    v = std::move(_stack.top());
+                    _stack.pop();
+                }
+                
+                // Make sure TOS is a List. Keep a reference while using it
+                Value listValue = std::move(_stack.top());
+                _stack.pop();
+                List* list = listValue.list();
+                if (!list) {
+                    _errorString = "target must be List for 'insert'";
+                    return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
+                }
+                if (op != Op::At && list->frozen()) {
+                    _errorString = "cannot change a List literal, store it in a var first";
+                    return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
+                }
+                
+                if (op == Op::Insert) {
+                    if (i > list->size()) {
+                        i = int32_t(list->size());
                     }
-                    case SA::lt:
-                    case SA::le:
-                    case SA::eq:
-                    case SA::ne:
-                    case SA::ge:
-                    case SA::gt: {
-                        float rhs = _stack.top().flt();
-                        _stack.pop();
-                        float lhs = _stack.top().flt();
-                        _stack.pop();
-                        bool result = false;
-                        switch(it.builtInVerb()) {
-                            case SA::lt: result = lhs < rhs; break;
-                            case SA::le: result = lhs <= rhs; break;
-                            case SA::eq: result = lhs == rhs; break;
-                            case SA::ne: result = lhs != rhs; break;
-                            case SA::ge: result = lhs >= rhs; break;
-                            case SA::gt: result = lhs > rhs; break;
-                            default: break;
-                        }
-                        _stack.push(result);
-                        break;
+                    list->insert(list->begin() + i, v);
+                    list->invalidateCode();
+                } else {
+                    if (i >= list->size()) {
+                        _errorString = m8r::String::format("at index %d out of range for list of size %d", i, list->size());
+                        return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
+                     }
+                
+                    if (op == Op::At) {
+                        _stack.push((*list)[i]);
+                    } else {
+                        (*list)[i] = std::move(v);
+                        list->invalidateCode();
                     }
-                    case SA::inc:
-                    case SA::dec: {
-                        if (_stack.top().type() == Value::Type::Int) {
-                            int32_t i = _stack.top().integer();
-                            if (it.builtInVerb() == SA::inc) {
-                                i++;
-                            } else {
-                                i--;
-                            }
-                            _stack.top() = i;
-                        } else {
-                             float f = _stack.top().flt();
-                            if (it.builtInVerb() == SA::inc) {
-                                f = f + 1;
-                            } else {
-                                f = f + 1;
-                            }
-                            _stack.top() = f;
-                       }
-                       break;
+                }
+            }
+            NEXT();
+            OPCODE(Lt):
+            OPCODE(Le):
+            OPCODE(Eq):
+            OPCODE(Ne):
+            OPCODE(Ge):
+            OPCODE(Gt): {
+                const Value& rhs = _stack.top();
+                const Value& lhs = _stack.top(-1);
+                bool result;
+                if (lhs.type() == Value::Type::Int && rhs.type() == Value::Type::Int) {
+                    result = compare(op, lhs.integer(), rhs.integer());
+                } else {
+                    result = compare(op, lhs.flt(), rhs.flt());
+                }
+                _stack.pop();
+                _stack.top() = Value(result);
+            }
+            NEXT();
+            OPCODE(Inc):
+            OPCODE(Dec): {
+                Value& value = _stack.top();
+                int32_t delta = (op == Op::Inc) ? 1 : -1;
+                if (value.type() == Value::Type::Int) {
+                    value = Value(int32_t(uint32_t(value.integer()) + uint32_t(delta)));
+                } else {
+                    value = Value(value.flt() + delta);
+                }
+            }
+            NEXT();
+            OPCODE(Println):
+            OPCODE(Print): {
+                String s;
+                _stack.top().toString(s);
+                print(s.string().c_str());
+                _stack.pop();
+                if (op == Op::Println) {
+                    print("\n");
+                }
+            }
+            NEXT();
+            OPCODE(Cat): {
+                // Move the operands off the stack so an unshared left
+                // String can be appended to in place
+                Value right = std::move(_stack.top());
+                _stack.pop();
+                Value left = std::move(_stack.top());
+                _stack.top() = String::cat(std::move(left), right);
+            }
+            NEXT();
+            OPCODE(CurrentTime): {
+                float t = float(double(m8r::Time::now().us()) / 1000000);
+                _stack.push(t);
+            }
+            NEXT();
+            OPCODE(Delay):
+                _delayTime = int64_t(double(_stack.top().flt()) * 1000000);
+                _delayEnd = m8r::Time::now().us() + _delayTime;
+                startDelay(m8r::Duration(_stack.top().flt()));
+                _stack.pop();
+                saveFrame();
+                return m8r::CallReturnValue(m8r::CallReturnValue::Type::Delay);
+            OPCODE(New): {
+                // Create a new Map, call the __ctor of the Value in TOS and push the Map
+                Value proto = std::move(_stack.top());
+                _stack.pop();
+                
+                Value obj(new Map(proto));
+                proto.property(SAtom(SA::__ctor))(this, obj);
+                _stack.push(std::move(obj));
+            }
+            ROOM_CHECK();
+            NEXT();
+            OPCODE(Loop):
+                if (!pushFrame(_stack.top(), State::LoopBody)) {
+                    return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
+                }
+                _stack.pop();
+                NEXT();
+            OPCODE(For):
+            OPCODE(While):
+            OPCODE(Fold):
+            OPCODE(Map):
+            OPCODE(Filter):
+                if (!startLoop(op)) {
+                    return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
+                }
+                ROOM_CHECK();
+                NEXT();
+            OPCODE(Break):
+            breakLoop:
+                // Pop frames up to and including the innermost loop
+                while (true) {
+                    if (_currentState == State::Function || _currentState == State::Event) {
+                        _errorString = "cannot 'break' out of function";
+                        return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
                     }
-                    case SA::println:
-                    case SA::print: {
-                        String s;
-                        _stack.top().toString(s);
-                        print(s.string().c_str());
-                        _stack.pop();
-                        if (it.builtInVerb() == SA::println) {
-                            print("\n");
+                    
+                    bool loop = _currentState >= State::LoopBody;
+                    if (_currentState > State::LoopBody) {
+                        // for still has S on the stack
+                        if (_currentState >= State::ForTest && _currentState <= State::ForIter && _stack.empty()) {
+                            return stackUnderflow(1);
                         }
-                        break;
-                    }
-                    case SA::cat: {
-                        String s1, s2;
-                        _stack.top().toString(s2);
-                        _stack.pop();
-                        _stack.top().toString(s1);
-                        _stack.pop();
-                        s1.string() += s2.string();
-                        _stack.push(s1.string().c_str());
-                        break;
+                        endLoop();
                     }
-                    case SA::currentTime: {
-                        float t = float(double(m8r::Time::now().us()) / 1000000);
-                        _stack.push(t);
+                    _frames.pop();
+                    assert(!_frames.empty());
+                    loadFrame();
+                    if (loop) {
                         break;
                     }
-                    case SA::delay:
-                        startDelay(m8r::Duration(_stack.top().flt()));
-                        _stack.pop();
-                        _codeStack.top(-1) = Value(_currentIndex);
-                        return m8r::CallReturnValue(m8r::CallReturnValue::Type::Delay);
-                    case SA::new$: {
-                        // Create a new Map and call the __ctor of the Value in TOS
-                        Value obj = _stack.top();
-                        _stack.pop();
-                        
-                        m8r::SharedPtr<Map> map(new Map(obj));
-                        break;
+                }
+                ROOM_CHECK();
+                NEXT();
+            OPCODE(If):
+                // Stack has body and bool. If bool is true execute body
+                if (_stack.top(-1).boolean()) {
+                    if (!pushFrame(_stack.top(), State::Body)) {
+                        return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
                     }
-                    case SA::loop:
-                        if (!initExec(_stack.top(), State::LoopBody)) {
-                            return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
-                        }
-                        _stack.pop();
-                        startExec();
-                        break;
-                    case SA::break$:
-                        action = Action::Break;
-                        break;
-                    case SA::if$:
-                        // Stack has body and bool. If bool is true execute body
-                        if (_stack.top(-1).boolean()) {
-                            if (!initExec(_stack.top(), State::Body)) {
-                                return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
-                            }
-                            _stack.pop(2);
-                            startExec();
-                        } else {
-                            _stack.pop(2);
-                        }
-                        break;
-//                    case SA::while {
-//                        // Push the while body and test
-//                        _codeStack.push(_stack.top()); // body
-//                        _codeStack.push(_stack.top(-1)); // test
-//                        _stack.pop(2);
-//                        _currentState = State::WhileTest;
-//                        
-//                        if (!initExec(_codeStack.top(), State::WhileTest) {
-//                            return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
-//                        }
-//                        startExec();
-//                    }
-//                    case SA::for$: {
-//                        m8r::SharedPtr<List> body = _stack.top().list();
-//                        _stack.pop();
-//                        m8r::SharedPtr<List> iter = _stack.top().list();
-//                        _stack.pop();
-//                        m8r::SharedPtr<List> test = _stack.top().list();
-//                        _stack.pop();
-//                        
-//                        // Iteration value is on TOS.
-//                        // FIXME: Check that the stack is the same size before executing each list
-//                        Value testResult;
-//                        
-//                        while (true) {
-//                            if (!execute(test)) {
-//                                return false;
-//                            }
-//                            _stack.pop(testResult);
-//                            if (!testResult.boolean()) {
-//                                _stack.pop();
-//                                break;
-//                            }
-//                            if (!execute(body)) {
-//                                return false;
-//                            }
-//                            if (!execute(iter)) {
-//                                return false;
-//                            }
-//                        }
-//                        break;
-//                    }
-                    default: {
-                        _errorString = m8r::String::format("unrecognized built-in verb '%s'", 
-                                        _atomTable.stringFromAtom(m8r::Atom(static_cast<m8r::Atom::value_type>(it.builtInVerb()))));
+                    _stack.pop(2);
+                    SAFE_POINT();
+                } else {
+                    _stack.pop(2);
+                    ROOM_CHECK();
+                }
+                NEXT();
+            OPCODE(AddInt8): {
+                int32_t rhs = _currentCode->int8(_pc);
+                Value& lhs = _stack.top();
+                if (lhs.type() == Value::Type::Int) {
+                    lhs = Value(int32_t(uint32_t(lhs.integer()) + uint32_t(rhs)));
+                } else {
+                    lhs = Value(lhs.flt() + rhs);
+                }
+            }
+            NEXT();
+            OPCODE(ArithInt8): {
+                Op arithOp = _currentCode->op(_pc);
+                int32_t rhs = _currentCode->int8(_pc);
+                Value& lhs = _stack.top();
+                if (lhs.type() == Value::Type::Int) {
+                    int32_t i;
+                    if (!intArith(arithOp, lhs.integer(), rhs, i)) {
+                        _errorString = "integer divide by zero";
                         return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
                     }
+                    lhs = Value(i);
+                } else {
+                    lhs = Value(floatArith(arithOp, lhs.flt(), float(rhs)));
                 }
-                break;
             }
+            NEXT();
+            OPCODE(DupCmpInt8): {
+                Op cmpOp = _currentCode->op(_pc);
+                int32_t rhs = _currentCode->int8(_pc);
+                const Value& lhs = _stack.top();
+                bool result = (lhs.type() == Value::Type::Int) ? compare(cmpOp, lhs.integer(), rhs) : compare(cmpOp, lhs.flt(), float(rhs));
+                _stack.push(result);
+            }
+            NEXT();
+            OPCODE(DupCmpLoad): {
+                Op cmpOp = _currentCode->op(_pc);
+                uint16_t slot = _currentCode->uint16(_pc);
+                const Value& lhs = _stack.top();
+                const Value& rhs = _globals[slot];
+                if (rhs.type() == Value::Type::Undefined) {
+                    return varNotFound(slot);
+                }
+                bool result;
+                if (lhs.type() == Value::Type::Int && rhs.type() == Value::Type::Int) {
+                    result = compare(cmpOp, lhs.integer(), rhs.integer());
+                } else {
+                    result = compare(cmpOp, lhs.flt(), rhs.flt());
+                }
+                _stack.push(result);
+            }
+            NEXT();
+            OPCODE(LoadLoadProp): {
+                uint16_t slot = _currentCode->uint16(_pc);
+                m8r::Atom prop(_currentCode->uint16(_pc));
+                if (_globals[slot].type() == Value::Type::Undefined) {
+                    return varNotFound(slot);
+                }
+                _stack.push(_globals[slot].property(prop));
+            }
+            NEXT();
+            OPCODE(BreakIf): {
+                bool b = _stack.top().boolean();
+                _stack.pop();
+                if (b) {
+                    goto breakLoop;
+                }
+            }
+            NEXT();
+            OPCODE(BreakIfCmpInt8): {
+                Op cmpOp = _currentCode->op(_pc);
+                int32_t rhs = _currentCode->int8(_pc);
+                const Value& lhs = _stack.top();
+                if ((lhs.type() == Value::Type::Int) ? compare(cmpOp, lhs.integer(), rhs) : compare(cmpOp, lhs.flt(), float(rhs))) {
+                    goto breakLoop;
+                }
+            }
+            NEXT();
+            OPCODE(Check): {
+                uint8_t needed = _currentCode->uint8(_pc);
+                if (_stack.size() < needed) {
+                    return stackUnderflow(needed);
+                }
+            }
+            NEXT();
+            OPCODE(UnknownVerb):
+                _errorString = m8r::String::format("unrecognized built-in verb '%s'", 
+                                stringFromAtom(m8r::Atom(_currentCode->uint16(_pc))));
+                return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
+            OPCODE(UnknownToken):
+                _errorString = "unrecognized verb '";
+                _errorString += char(_currentCode->uint16(_pc));
+                _errorString += "'";
+                return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
+            OPCODE(End):
+                if (_currentState >= State::LoopBody) {
+                    Iteration next = nextIteration();
+                    if (next == Iteration::Again) {
+                        ROOM_CHECK();
+                        SAFE_POINT();
+                        NEXT();
+                    }
+                    if (next == Iteration::Underflow) {
+                        return stackUnderflow(loopResults(_currentState));
+                    }
+                }
+                
+                // Done with the current function. pop it
+                if (_currentState == State::Event) {
+                    if (_stack.size() < _eventStackSize) {
+                        _errorString = "event handler took values from the stack it didn't push";
+                        return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
+                    }
+                    
+                    // Anything it left would be taken by the interrupted code
+                    _stack.pop(_stack.size() - _eventStackSize);
+                    _inEvent = false;
+                }
+                _frames.pop();
+                if (_frames.empty()) {
+                    // Run the next form of an incremental load as soon
+                    // as it arrives
+                    if (!_forms.empty()) {
+                        pushForm();
+                        loadFrame();
+                        ROOM_CHECK();
+                        SAFE_POINT();
+                        NEXT();
+                    }
+                    if (_loading) {
+                        return m8r::CallReturnValue(m8r::CallReturnValue::Type::WaitForEvent);
+                    }
+#ifdef MARLY_PROFILE
+                    printProfile();
+#endif
+                    return m8r::CallReturnValue(m8r::CallReturnValue::Type::Finished);
+                }
+                loadFrame();
+                ROOM_CHECK();
+                
+                // After an event handler run the next one. If there are
+                // none and it ran during a delay, wait for the rest of it
+                if (!_inEvent) {
+                    if (_eventCount) {
+                        dispatchEvent();
+                    } else if (resumeDelay()) {
+                        saveFrame();
+                        return m8r::CallReturnValue(m8r::CallReturnValue::Type::Delay);
+                    }
+                }
+                NEXT();
+#if !MARLY_COMPUTED_GOTO
+            default:
+                _errorString = "unrecognized opcode";
+                return m8r::CallReturnValue(m8r::Error::Code::RuntimeError);
+        }
+#endif
+    }
+}
+
+void Marly::fireEvent(const Value& event)
+{
+    const List* list = event.list();
+    if (!list) {
+        return;
+    }
+    
+    _eventStats.fired++;
+    if (!_program->canUse(event)) {
+        _eventStats.dropped++;
+        return;
+    }
+    for (uint32_t i = 0; i < _eventCount; ++i) {
+        if (_events[(_eventHead + i) % MaxEvents].list() == list) {
+            _eventStats.coalesced++;
+            return;
+        }
+    }
+    
+    if (_eventCount == MaxEvents) {
+        _eventStats.dropped++;
+        return;
+    }
+    
+    _events[(_eventHead + _eventCount++) % MaxEvents] = event;
+    _eventStats.maxPending = std::max(_eventStats.maxPending, _eventCount);
+    if (_eventNotify) {
+        _eventNotify();
+    }
+}
+
+void Marly::dispatchEvent()
+{
+    Value event = std::move(_events[_eventHead]);
+    _eventHead = (_eventHead + 1) % MaxEvents;
+    --_eventCount;
+    
+    // Like a full queue, an event is dropped if there isn't room to run it
+    // or it uses vars this Program doesn't have
+    Frame frame(event.list(), State::Event);
+    if (!hasRoom(frame.code.get()) || !frame.code->runnable(uint16_t(_globals.size()))) {
+        _eventStats.dropped++;
+        return;
+    }
+    _eventStats.dispatched++;
+    
+    if (!_frames.empty()) {
+        saveFrame();
+    }
+    _frames.push(frame);
+    loadFrame();
+    _inEvent = true;
+    _eventStackSize = uint32_t(_stack.size());
+}
+
+bool Marly::resumeDelay()
+{
+    if (!_delayEnd) {
+        return false;
+    }
+    
+    int64_t remaining = _delayEnd - m8r::Time::now().us();
+    if (remaining <= 0) {
+        _delayEnd = 0;
+        return false;
+    }
+    
+    _delayTime = remaining;
+    startDelay(m8r::Duration(float(double(remaining) / 1000000)));
+    return true;
+}
+
+void Marly::startSlice()
+{
+    _stepsLeft = _sliceSteps;
+    if (_sliceTime) {
+        _sliceEnd = m8r::Time::now().us() + _sliceTime;
+    }
+    _budgetChunk = _budgetLeft = stepsToNextCheck();
+}
+
+uint32_t Marly::stepsToNextCheck() const
+{
+    uint32_t steps = _sliceTime ? TimeCheckSteps : std::numeric_limits<uint32_t>::max();
+    return (_sliceSteps && _stepsLeft < steps) ? _stepsLeft : steps;
+}
+
+bool Marly::sliceExpired()
+{
+    if (_sliceSteps) {
+        _stepsLeft -= _budgetChunk;
+        if (_stepsLeft == 0) {
+            return true;
         }
     }
+    if (_sliceTime && m8r::Time::now().us() >= _sliceEnd) {
+        return true;
+    }
+    _budgetChunk = _budgetLeft = stepsToNextCheck();
+    return false;
 }
 
-bool Marly::initExec(const Value& list, State state)
+bool Marly::pushFrame(const Value& list, State state)
 {
     if (list.type() != Value::Type::List) {
         _errorString = "value to exec must be List";
         return false;
     }
     
-    // Save the current index and state
-    _codeStack.top() = Value(int32_t(_currentState));
-    _codeStack.top(-1) = Value(_currentIndex);
+    // A call which is the last thing a Function or Body does replaces the
+    // current frame, so tail recursion runs in constant space. If either
+    // one is a Function the result is too, so 'break' still can't escape it
+    bool isCall = state == State::Function || state == State::Body;
+    bool inCall = _currentState == State::Function || _currentState == State::Body;
+    if (isCall && inCall && static_cast<Op>(*_pc) == Op::End) {
+        if (_currentState == State::Function) {
+            state = State::Function;
+        }
+        _frames.top() = Frame(list.list(), state);
+    } else {
+        if (_frames.size() >= MaxFrames) {
+            _errorString = m8r::String::format("calls nested too deep, limit is %d", int32_t(MaxFrames));
+            return false;
+        }
+        saveFrame();
+        _frames.push(Frame(list.list(), state));
+    }
+    loadFrame();
+    if (!canRun(_currentCode)) {
+        return false;
+    }
+    if (!hasRoom(_currentCode)) {
+        // Just sets the error
+        stackOverflow();
+        return false;
+    }
+    return true;
+}
+
+bool Marly::canRun(const Code* code)
+{
+    if (code->runnable(uint16_t(_globals.size()))) {
+        return true;
+    }
+    _errorString = "List uses a var which is not in this program";
+    return false;
+}
+
+void Marly::loadFrame()
+{
+    const Frame& frame = _frames.top();
+    _currentState = frame.state;
+    _pc = frame.pc;
+    
+    switch (_currentState) {
+        case State::ForTest:
+        case State::WhileTest: _currentCode = _loops.top().test.get(); break;
+        case State::ForIter: _currentCode = _loops.top().iter.get(); break;
+        case State::ForBody:
+        case State::WhileBody:
+        case State::FoldBody:
+        case State::MapBody:
+        case State::FilterBody: _currentCode = _loops.top().body.get(); break;
+        default: _currentCode = frame.code.get(); break;
+    }
+    assert(_pc >= _currentCode->begin() && _pc < _currentCode->end());
+}
 
-    _codeStack.push(list);
-    _codeStack.push(0);
-    _codeStack.push(int32_t(state));
+uint32_t Marly::loopResults(State state)
+{
+    switch (state) {
+        case State::ForTest: return 2;          // S and the result of B
+        case State::ForBody:
+        case State::ForIter: return 1;          // S
+        case State::WhileTest:
+        case State::MapBody:
+        case State::FilterBody: return 1;       // The result
+        default: return 0;
+    }
+}
+
+bool Marly::runKernel(Op op)
+{
+    // Stack is A V0 P for fold and A P for map and filter
+    CodeRef code(_stack.top().list());
+    const List* source = _stack.top((op == Op::Fold) ? -2 : -1).list();
+    Value result;
+    
+    if (op == Op::Fold) {
+        if (!_kernel.compileFold(*code.get()) || !_kernel.fold(*source, _stack.top(-1), result)) {
+            return false;
+        }
+        _stack.pop(3);
+    } else {
+        if (!_kernel.compileUnary(*code.get())) {
+            return false;
+        }
+        List* list = new List();
+        result = Value(list);
+        if (!((op == Op::Map) ? _kernel.map(*source, *list) : _kernel.filter(*source, *list))) {
+            return false;
+        }
+        _stack.pop(2);
+    }
+    _stack.push(result);
     return true;
 }
 
-void Marly::startExec()
+bool Marly::startLoop(Op op)
+{
+    // Lists are on TOS, topmost last:
+    //
+    //      for     S B I X
+    //      while   B X
+    //      fold    A V0 P
+    //      map     A P
+    //      filter  A P
+    //
+    // lists has a bit set for each stack position, from TOS down, which
+    // must be a List
+    const char* name;
+    uint8_t lists;
+    switch (op) {
+        case Op::For: name = "for"; lists = 0x07; break;
+        case Op::While: name = "while"; lists = 0x03; break;
+        case Op::Fold: name = "fold"; lists = 0x05; break;
+        case Op::Map: name = "map"; lists = 0x03; break;
+        default: name = "filter"; lists = 0x03; break;
+    }
+    for (int32_t i = 0; lists; ++i, lists >>= 1) {
+        if ((lists & 1) && (i >= int32_t(_stack.size()) || _stack.top(-i).type() != Value::Type::List)) {
+            _errorString = m8r::String::format("'%s' requires List arguments", name);
+            return false;
+        }
+    }
+    
+    if (op != Op::For && op != Op::While && runKernel(op)) {
+        return true;
+    }
+    
+    // first is the list the loop starts with
+    LoopRecord loop;
+    Value first = _stack.top();
+    loop.body = first.list();
+    State state;
+    
+    switch (op) {
+        case Op::For:
+            loop.iter = _stack.top(-1).list();
+            loop.test = _stack.top(-2).list();
+            first = _stack.top(-2);
+            _stack.pop(3);
+            state = State::ForTest;
+            break;
+        case Op::While:
+            loop.test = _stack.top(-1).list();
+            first = _stack.top(-1);
+            _stack.pop(2);
+            state = State::WhileTest;
+            break;
+        case Op::Fold: {
+            // Leave V0 on TOS as the initial accumulated value
+            Value initial = std::move(_stack.top(-1));
+            loop.source = std::move(_stack.top(-2));
+            _stack.pop(3);
+            _stack.push(initial);
+            state = State::FoldBody;
+            break;
+        }
+        default:
+            loop.source = std::move(_stack.top(-1));
+            loop.result = Value(new List());
+            _stack.pop(2);
+            state = (op == Op::Map) ? State::MapBody : State::FilterBody;
+            break;
+    }
+    
+    for (const CodeRef* code : { &loop.test, &loop.iter, &loop.body }) {
+        if (code->get() && !canRun(code->get())) {
+            return false;
+        }
+    }
+    
+    if (loop.source.type() == Value::Type::List) {
+        // Iterating a list. If it is empty the loop is already done
+        const List* source = loop.source.list();
+        if (source->empty()) {
+            if (state != State::FoldBody) {
+                _stack.push(loop.result);
+            }
+            return true;
+        }
+        _stack.push((*source)[0]);
+    }
+    
+    _loops.push(loop);
+    return pushFrame(first, state);
+}
+
+Marly::Iteration Marly::nextIteration()
 {
-    _currentState = static_cast<State>(_codeStack.top().integer());
-    _currentIndex = _codeStack.top(-1).integer();
-    _currentCode = _codeStack.top(-2).list();
-    assert(_currentIndex >= 0 && _currentIndex <= _currentCode->size());
+    // The values the loop takes from the list which just ended are only
+    // checked if the verifier couldn't tell they are there. How many are
+    // there lets the next list skip its Check
+    uint32_t depth = _currentCode->endDepth();
+    auto missing = [this, &depth](uint32_t results) {
+        if (depth >= results) {
+            return false;
+        }
+        depth = results;
+        return _stack.size() < results;
+    };
+    
+    if (_currentState == State::LoopBody) {
+        _pc = _currentCode->start(depth);
+        return Iteration::Again;
+    }
+
+    LoopRecord& loop = _loops.top();
+    switch (_currentState) {
+        case State::ForTest:
+        case State::WhileTest: {
+            if (missing(loopResults(_currentState))) {
+                return Iteration::Underflow;
+            }
+            bool result = _stack.top().boolean();
+            _stack.pop();
+            if (!result) {
+                endLoop();
+                return Iteration::Done;
+            }
+            _currentState = (_currentState == State::ForTest) ? State::ForBody : State::WhileBody;
+            _currentCode = loop.body.get();
+            _pc = _currentCode->start(depth - 1);
+            return Iteration::Again;
+        }
+        case State::ForBody:
+            if (missing(loopResults(State::ForBody))) {
+                return Iteration::Underflow;
+            }
+            _currentState = State::ForIter;
+            _currentCode = loop.iter.get();
+            _pc = _currentCode->start(depth);
+            return Iteration::Again;
+        case State::ForIter:
+            if (missing(loopResults(State::ForIter))) {
+                return Iteration::Underflow;
+            }
+            _currentState = State::ForTest;
+            _currentCode = loop.test.get();
+            _pc = _currentCode->start(depth);
+            return Iteration::Again;
+        case State::WhileBody:
+            _currentState = State::WhileTest;
+            _currentCode = loop.test.get();
+            _pc = _currentCode->start(depth);
+            return Iteration::Again;
+        case State::MapBody:
+            if (missing(loopResults(State::MapBody))) {
+                return Iteration::Underflow;
+            }
+            loop.result.list()->push_back(std::move(_stack.top()));
+            _stack.pop();
+            --depth;
+            break;
+        case State::FilterBody:
+            if (missing(loopResults(State::FilterBody))) {
+                return Iteration::Underflow;
+            }
+            if (_stack.top().boolean()) {
+                loop.result.list()->push_back((*loop.source.list())[loop.index]);
+            }
+            _stack.pop();
+            --depth;
+            break;
+        default:
+            break;
+    }
+    
+    // fold, map and filter go on to the next element
+    const List* source = loop.source.list();
+    if (++loop.index >= int32_t(source->size())) {
+        endLoop();
+        return Iteration::Done;
+    }
+    _stack.push((*source)[loop.index]);
+    _pc = _currentCode->start(depth + 1);
+    return Iteration::Again;
+}
+
+void Marly::endLoop()
+{
+    switch (_currentState) {
+        case State::ForTest:
+        case State::ForBody:
+        case State::ForIter:
+            // Pop S
+            _stack.pop();
+            break;
+        case State::MapBody:
+        case State::FilterBody:
+            _stack.push(_loops.top().result);
+            break;
+        default:
+            break;
+    }
+    _loops.pop();
+}
+
+#ifdef MARLY_PROFILE
+void Marly::profileOp(Op op)
+{
+    // _opHistory holds the previous 2 ops, most recent in the low byte.
+    // Sequences are not counted across the end of a list
+    auto count = [this](uint32_t key) {
+        auto it = _ngrams.find(key);
+        if (it == _ngrams.end()) {
+            _ngrams.emplace(key, 1);
+        } else {
+            it->value++;
+        }
+    };
+    
+    if (_opHistoryCount >= 1) {
+        count((2 << 24) | ((_opHistory & 0xff) << 8) | uint8_t(op));
+    }
+    if (_opHistoryCount >= 2) {
+        count((3 << 24) | ((_opHistory & 0xffff) << 8) | uint8_t(op));
+    }
+    
+    if (op == Op::End) {
+        _opHistoryCount = 0;
+    } else {
+        _opHistory = (_opHistory << 8) | uint8_t(op);
+        if (_opHistoryCount < 2) {
+            ++_opHistoryCount;
+        }
+    }
+}
+
+void Marly::printProfile(uint32_t count) const
+{
+    m8r::Vector<uint32_t> keys;
+    for (const auto& it : _ngrams) {
+        keys.push_back(it.key);
+    }
+    std::sort(keys.begin(), keys.end(), [this](uint32_t a, uint32_t b) {
+        return _ngrams.find(a)->value > _ngrams.find(b)->value;
+    });
+    
+    print("\nMost frequent op sequences:\n");
+    for (uint32_t i = 0; i < keys.size() && i < count; ++i) {
+        uint32_t key = keys[i];
+        m8r::String s = m8r::String::format("%10u ", _ngrams.find(key)->value);
+        for (int32_t j = (key >> 24) - 1; j >= 0; --j) {
+            s += " ";
+            s += Code::opName(static_cast<Op>((key >> (j * 8)) & 0xff));
+        }
+        s += "\n";
+        print(s.c_str());
+    }
 }
+#endif
@@ -13,6 +13,10 @@
 #include "Containers.h"
 #include "Executable.h"
 #include "GeneratedValues.h"
+#include "MarlyCode.h"
+#include "MarlyKernel.h"
+#include "MarlyProgram.h"
+#include "MarlyStack.h"
 #include "MString.h"
 #include "Scanner.h"
 #include "ScriptingLanguage.h"
@@ -84,11 +88,13 @@ Operators:
     swap        X Y -> Y X
                 Interchanges X and Y on top of the stack.
                 
-    pick        A0..Ai..An i -> A0..An Ai
-                Remove the ith item on the stack and push it
+    pick        Ai..A1 A0 i -> A(i-1)..A0 Ai
+                Remove the ith item down the stack and push it. 0 is TOS, so
+                "0 pick" does nothing and "1 pick" is swap.
                 
-    tuck        A0..A(i-1) Ai..An X i -> A0..A(i-1) X Ai..An
-                Insert X n locations down the stack
+    tuck        Ai..A1 A0 X i -> Ai X A(i-1)..A0
+                Insert X i locations down the stack. "0 tuck" does nothing and
+                "1 tuck" is swap.
 
     pop         X ->
                 Removes X from top of the stack.
@@ -154,7 +160,9 @@ Operators:
                 B = X > Y
 
     +           X Y -> Z
-                Z = X + Y. Numbers can be int or float.
+                Z = X + Y. Numbers can be int or float. If both are int the result
+                is int, wrapping on overflow. Otherwise the result is float. The
+                same is true for -, *, / and %.
 
     -           X Y -> Z
                 Z = X - Y. Numbers can be int or float.
@@ -163,7 +171,8 @@ Operators:
                 Z = X times Y. Numbers can be int or float.
 
     /           X Y -> Z
-                Z = X divided by Y. Numbers can be int or float.
+                Z = X divided by Y. Numbers can be int or float. Int division
+                truncates toward zero.
 
     %           X Y -> Z
                 Z = X modulo Y. Numbers can be int or float.
@@ -187,7 +196,7 @@ Operators:
                 Execute B. Pop the result from the stack. If result is true execute X then 
                 I. Repeat until not true. S is the current iteration value and remains on 
                 TOS. It can be modified by any of the lists, but must be the only element 
-                left on the stack at the end of execution.
+                left on the stack at the end of execution. S is popped when the loop ends.
 
     fold        A V0 [P] -> V
                 Starting with value V0, push each member of A and execute P to produce value V.
@@ -198,6 +207,10 @@ Operators:
     filter      A [B] -> A1
                 Execute B on each element of A. If true that element is added to list A1
 
+                fold, map and filter of a List of all Int or all Float, with a simple
+                arithmetic or comparison list such as [2 *] or [0 gt], run as a native
+                loop. See MarlyKernel.h
+
     import      "S" -> O
                 import package S, pushing O which contains elements of S
 */
@@ -219,42 +232,302 @@ public:
     
     Marly();
     
+    // Loads source or a Program image, see Program::writeImage()
     virtual bool load(const m8r::Stream&) override;
+    
+    // Load an image in memory, such as an mmapped file or flash, without
+    // copying it. The image must outlive every Marly using the Program
+    bool loadImage(const uint8_t* image, uint32_t size);
+    
+    // Incremental loading, for a script which arrives a piece at a time.
+    // loadChunk() reads the stream until eof() and parses each complete
+    // form. A form is everything up to a newline outside of any List,
+    // String or comment. execute() runs each form as soon as it is parsed
+    // and returns WaitForEvent while it waits for more, until endLoad().
+    // Only the text of the current form is kept, up to maxFormSize bytes
+    // not counting comments.
+    // A form with errors is skipped and loadChunk() returns false. The
+    // Program can't be written as an image or shared.
+    static constexpr uint32_t DefaultMaxFormSize = 1024;
+    
+    void startLoad(uint32_t maxFormSize = DefaultMaxFormSize);
+    bool loadChunk(const m8r::Stream&);
+    bool endLoad();
+    
+    // Run the Optimizer over source given to load() before it is compiled.
+    // With print, the optimized source and a count of each rewrite are
+    // printed. It assumes the host never sets a var which is inlined.
+    // Off by default. Incremental loading is not optimized
+    void setOptimize(bool optimize, bool print = false) { _optimize = optimize; _printOptimized = print; }
+    
     virtual m8r::CallReturnValue execute() override;
     virtual const char* runtimeErrorString() const override { return _errorString.c_str(); }
     virtual const m8r::ParseErrorList* parseErrors() const override { return &_parseErrors; }
 
-    const char* stringFromAtom(m8r::Atom atom) const { return _atomTable.stringFromAtom(atom); }
+    const char* stringFromAtom(m8r::Atom atom) const { return _program->atomTable().stringFromAtom(atom); }
+    
+    // The loaded Program. It can be given to any number of other Marly
+    // instances with setProgram() instead of each loading it. Each one runs
+    // it with its own stack and vars. Setting a Program drops anything
+    // left running from the old one, including pending events.
+    const m8r::SharedPtr<Program>& program() const { return _program; }
+    void setProgram(const m8r::SharedPtr<Program>&);
+    
+    // Access to global vars by name, for native code and for names which
+    // are not known when the program is loaded. Getting an unknown var
+    // returns Undefined. Setting one creates it, and it is kept when a
+    // Program is set unless it refers to the old Program. Setting a var to
+    // something from another Program fails, see Program::canUse().
+    Value global(m8r::Atom) const;
+    bool setGlobal(m8r::Atom, const Value&);
+    
+    // Queue list to run as an event handler. It runs at the next safe
+    // point, a call or loop iteration, or the next time execute() is
+    // called, even during a delay. An event for a list which is already
+    // queued is coalesced into it. When the queue is full, or the list is
+    // from another Program, the event is dropped. Only allocates to check
+    // a list which isn't part of the Program. Not locked, so it must be
+    // called from the
+    // thread running the program. Use ThreadPool::fireEvent() for programs
+    // run by a ThreadPool.
+    void fireEvent(const Value& list);
+    
+    struct EventStats
+    {
+        uint32_t fired = 0;
+        uint32_t coalesced = 0;
+        uint32_t dropped = 0;
+        uint32_t dispatched = 0;
+        uint32_t maxPending = 0;
+    };
+    
+    const EventStats& eventStats() const { return _eventStats; }
+    uint32_t pendingEvents() const { return _eventCount; }
+    
+    // Called whenever an event is queued, and when an incremental load
+    // has a form ready to run or ends, so a host can wake a program which
+    // is waiting in a delay or for input
+    void setEventNotify(const std::function<void()>& notify) { _eventNotify = notify; }
+    
+    // Limit how long execute() runs before returning Yield, in steps
+    // (calls and loop iterations) and in microseconds. It continues where
+    // it left off next time. 0 means no limit.
+    void setSliceBudget(uint32_t steps) { _sliceSteps = steps; }
+    void setSliceTime(int64_t time) { _sliceTime = time; }
+    
+    // Capacity of the operand stack, in Values. It is allocated once and
+    // never grows. Set it before the first execute(). False if the stack
+    // isn't empty, for instance after a runtime error left values on it
+    bool setStackSize(uint32_t values) { return _stack.setCapacity(values); }
+    uint32_t stackSize() const { return _stack.capacity(); }
     
-    void fireEvent(const Value&) { }
+    // Calls, if bodies and loops nest at most this deep. A call which is
+    // the last thing a List does replaces its frame, so tail recursion
+    // never reaches it
+    static constexpr uint32_t MaxFrames = 256;
+    
+    // Length in microseconds of the delay when execute() returned Delay
+    int64_t delayTime() const { return _delayTime; }
+    
+    // Print allocation counts and fragmentation of the object pools
+    void printMemoryStats() const;
 
-private:
-    enum class State { Function, Body, ForTest, ForBody, ForIter, WhileTest, WhileBody, LoopBody };
+#ifdef MARLY_PROFILE
+    void printProfile(uint32_t count = 20) const;
+#endif
 
-    bool initExec(const Value& list, State = State::Function);
-    void startExec();
+private:
+    // States from LoopBody on are loops, which 'break' exits. Event is
+    // the frame of an event handler
+    enum class State { Function, Body, Event, LoopBody, ForTest, ForBody, ForIter, WhileTest, WhileBody, FoldBody, MapBody, FilterBody };
+
+    // Calls and returns. The running frame is cached in _currentCode, _pc
+    // and _currentState. pushFrame saves them in the top frame before
+    // pushing a new one. loadFrame reloads them from the top frame.
+    bool pushFrame(const Value& list, State = State::Function);
+    void saveFrame()
+    {
+        _frames.top().pc = _pc;
+        _frames.top().state = _currentState;
+    }
+    void loadFrame();
+    
+    // Values a List run by a loop must leave on the stack for the loop
+    static uint32_t loopResults(State);
+    
+    // for, while, fold, map and filter run in a single frame. Its code is
+    // switched between the lists of the loop as it runs. nextIteration()
+    // sets _pc to the start of the next list
+    enum class Iteration { Again, Done, Underflow };
+    
+    bool startLoop(Op);
+    Iteration nextIteration();
+    void endLoop();
+    
+    // Run a fold, map or filter with a Kernel. False if it can't be, with
+    // the stack unchanged
+    bool runKernel(Op);
+    
+    bool setImageProgram(const m8r::SharedPtr<Program>&, const char* error);
+    void bindHostGlobals(uint16_t first);
+    
+    // Parse into the List on top of _parseStack
+    bool parse(const m8r::Stream&);
+    
+    bool scanForEndOfForm(char);
+    bool parseForm();
+    void pushForm();
+    
+    // String literals are interned so every occurrence of the same literal
+    // shares one immutable String
+    Value stringLiteral(const char*);
+    m8r::CallReturnValue varNotFound(uint16_t slot);
+    m8r::CallReturnValue stackUnderflow(uint32_t needed);
+    m8r::CallReturnValue stackOverflow();
+    
+    // Checked whenever code starts or resumes, so there is room for what
+    // it pushes before it calls anything, and for the value a loop pushes
+    // before running a List
+    bool hasRoom(const Code* code) const { return _stack.room() > code->growth(); }
+    
+    // Checked whenever a List starts, since one changed at runtime or
+    // kept from another Program can use vars this one doesn't have. Sets
+    // the error if not
+    bool canRun(const Code*);
     
     bool addParseError(const char* desc)
     {
-        _parseErrors.emplace_back(desc, _scanner.lineno());
+        _parseErrors.emplace_back(desc, _lineOffset + _scanner.lineno());
         return _parseErrors.size() > MaxErrors;
     }
     
     m8r::Scanner _scanner;
-
-    ValueMap _vars;
-    m8r::Stack<Value> _stack;
-    m8r::Stack<Value> _codeStack;
-    m8r::AtomTable _atomTable;
+    
+    // Declared before anything holding its Values, so it is destroyed last
+    m8r::SharedPtr<Program> _program;
+
+    // Global vars, one for each slot of the Program, Undefined until
+    // stored. Vars the host sets which the Program doesn't use go in
+    // _hostGlobals
+    ValueVector _globals;
+    ValueMap _hostGlobals;
+    
+    // Interned String literals, by hash of their contents
+    m8r::Map<uint32_t, Value> _stringLiterals;
+    OperandStack _stack;
+    
+    // Lists being built by load(). The finished outermost list is the
+    // root of _program
+    m8r::Stack<Value> _parseStack;
+    
+    // Incremental loading. _forms are parsed and waiting to run
+    enum class TextState : uint8_t { Code, Slash, LineComment, BlockComment, BlockCommentStar, String, StringEscape };
+    static bool isComment(TextState state)
+    {
+        return state == TextState::LineComment || state == TextState::BlockComment || state == TextState::BlockCommentStar;
+    }
+    
+    ValueVector _forms;
+    m8r::String _formText;
+    uint32_t _maxFormSize = DefaultMaxFormSize;
+    uint16_t _formDepth = 0;
+    TextState _textState = TextState::Code;
+    char _quote = 0;
+    bool _skipForm = false;
+    bool _loading = false;
+    bool _optimize = false;
+    bool _printOptimized = false;
+    
+    // Line numbers of errors are relative to the start of the form
+    uint32_t _lineOffset = 0;
+    uint32_t _lineCount = 0;
+    
+    // An activation of a List. The code of a loop frame switches between
+    // the lists in its LoopRecord, code is just the one it started with
+    struct Frame
+    {
+        Frame() { }
+        Frame(const CodeRef& code, State state) : code(code), pc(code->begin()), state(state) { }
+        
+        CodeRef code;
+        const uint8_t* pc = nullptr;
+        State state = State::Function;
+    };
+    
+    m8r::Stack<Frame> _frames;
+    
+    // The lists and progress of a for, while, fold, map or filter. The
+    // innermost loop frame on _frames belongs to the top record
+    struct LoopRecord
+    {
+        CodeRef test;
+        CodeRef iter;
+        CodeRef body;
+        Value source;   // List iterated by fold, map and filter
+        Value result;   // List built by map and filter
+        int32_t index = 0;
+    };
+    
+    m8r::Stack<LoopRecord> _loops;
+    Kernel _kernel;
     m8r::Map<m8r::Atom, Verb> _verbs;
     
     static constexpr uint16_t MaxErrors = 32;
+    static constexpr uint16_t MaxGlobals = 0xffff;
     State _currentState = State::Function;
-    int32_t _currentIndex = 0;
-    m8r::SharedPtr<List> _currentCode;
+    const Code* _currentCode = nullptr;
+    const uint8_t* _pc = nullptr;
+    
+    void dispatchEvent();
+    bool resumeDelay();
+    
+    static constexpr uint32_t MaxEvents = 16;
+    
+    // Ring of pending event handlers
+    Value _events[MaxEvents];
+    uint32_t _eventHead = 0;
+    uint32_t _eventCount = 0;
+    bool _inEvent = false;
+    
+    // Depth of the stack when the event handler started. It must not take
+    // values from the code it interrupted, whose Checks have already been
+    // done, and anything it leaves is dropped when it ends
+    uint32_t _eventStackSize = 0;
+    EventStats _eventStats;
+    std::function<void()> _eventNotify;
+    
+    // When the current delay ends, 0 if not delayed
+    int64_t _delayEnd = 0;
+    
+    void startSlice();
+    bool sliceExpired();
+    uint32_t stepsToNextCheck() const;
+    
+    // The clock is only read every TimeCheckSteps steps
+    static constexpr uint32_t TimeCheckSteps = 64;
+    
+    uint32_t _sliceSteps = 0;
+    int64_t _sliceTime = 0;
+    uint32_t _stepsLeft = 0;
+    int64_t _sliceEnd = 0;
+    
+    // Steps until sliceExpired() is next called
+    uint32_t _budgetLeft = 0;
+    uint32_t _budgetChunk = 0;
+    int64_t _delayTime = 0;
     
     m8r::String _errorString;
     m8r::ParseErrorList _parseErrors;
+
+#ifdef MARLY_PROFILE
+    void profileOp(Op);
+    
+    // Counts of executed op sequences. Key is the sequence length in
+    // the high byte followed by the ops, one per byte
+    m8r::Map<uint32_t, uint32_t> _ngrams;
+    uint32_t _opHistory = 0;
+    uint8_t _opHistoryCount = 0;
+#endif
 };    
 
 }
@@ -0,0 +1,548 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "MarlyCode.h"
+
+#include <algorithm>
+#include <limits>
+
+using namespace marly;
+
+namespace marly {
+
+// Lowers List elements to instructions. After each instruction is added,
+// the tail of the code is checked for sequences which can be fused into
+// a superinstruction. Code has no jumps so the tail can be rewritten freely.
+class CodeBuilder
+{
+public:
+    CodeBuilder(Code& code) : _code(code._code), _constants(code._constants) { }
+    
+    void emitValue(const Value&);
+    void emitBuiltInVerb(SA);
+    void emitTokenVerb(m8r::Token);
+
+    void emit(Op op)
+    {
+        _starts.push_back(int32_t(_code.size()));
+        _code.push_back(static_cast<uint8_t>(op));
+    }
+    
+    void emit(Op op, uint8_t operand)
+    {
+        emit(op);
+        _code.push_back(operand);
+    }
+
+    void emit(Op op, uint16_t operand)
+    {
+        emit(op);
+        appendUInt16(operand);
+    }
+
+    void emit(Op op, Op operand1, int8_t operand2)
+    {
+        emit(op);
+        _code.push_back(static_cast<uint8_t>(operand1));
+        _code.push_back(uint8_t(operand2));
+    }
+
+    // Check the most recent instructions for sequences to fuse
+    void fuse();
+    
+private:
+    void appendUInt16(uint16_t value)
+    {
+        _code.push_back(uint8_t(value));
+        _code.push_back(uint8_t(value >> 8));
+    }
+    
+    // Opcode and operands of the instruction i back from the last one
+    bool has(uint32_t i) const { return _starts.size() > i; }
+    int32_t start(uint32_t i) const { return _starts[_starts.size() - 1 - i]; }
+    Op op(uint32_t i) const { return has(i) ? static_cast<Op>(_code[start(i)]) : Op::Count; }
+    uint8_t uint8(uint32_t i, int32_t offset = 1) const { return _code[start(i) + offset]; }
+    int8_t int8(uint32_t i, int32_t offset = 1) const { return static_cast<int8_t>(uint8(i, offset)); }
+    uint16_t uint16(uint32_t i, int32_t offset = 1) const { return uint16_t(uint8(i, offset)) | (uint16_t(uint8(i, offset + 1)) << 8); }
+    
+    // Remove the last n instructions
+    void rewind(uint32_t n)
+    {
+        _code.resize(start(n - 1));
+        _starts.resize(_starts.size() - n);
+    }
+    
+    static bool isComparison(Op op) { return op >= Op::Lt && op <= Op::Gt; }
+    static bool isArithmetic(Op op) { return op >= Op::Add && op <= Op::Mod; }
+    bool isBreakList(uint32_t i) const;
+    
+    m8r::Vector<uint8_t>& _code;
+    ValueVector& _constants;
+    m8r::Vector<int32_t> _starts;
+};
+
+}
+
+Code::Code(const List& list)
+{
+    _code.reserve(list.size() + 1);
+    
+    CodeBuilder builder(*this);
+    for (const auto& it : list) {
+        builder.emitValue(it);
+        builder.fuse();
+    }
+    builder.emit(Op::End);
+    insertChecks();
+    
+    _begin = &_code[0];
+    _size = int32_t(_code.size());
+    
+    _valid = verify(std::numeric_limits<uint16_t>::max());
+}
+
+bool Code::effect(Op op, Effect& effect)
+{
+    // From the signatures in Marly.h
+    switch(op) {
+        case Op::PushFalse:
+        case Op::PushTrue:      effect = { 0, 1, 0, false }; return true;
+        case Op::PushInt8:
+        case Op::PushConst:     effect = { 0, 1, 1, false }; return true;
+        case Op::PushConstWide:
+        case Op::Load:          effect = { 0, 1, 2, false }; return true;
+        case Op::Store:         effect = { 1, 0, 2, false }; return true;
+        case Op::Exec:          effect = { 0, 0, 2, true }; return true;
+        case Op::LoadProp:
+        case Op::ExecProp:      effect = { 1, 1, 2, false }; return true;
+        case Op::StoreProp:     effect = { 2, 0, 2, false }; return true;
+        case Op::CallVerb:      effect = { 0, 0, 2, true }; return true;
+        case Op::Add:
+        case Op::Sub:
+        case Op::Mul:
+        case Op::Div:
+        case Op::Mod:           effect = { 2, 1, 0, false }; return true;
+        case Op::Dup:           effect = { 1, 2, 0, false }; return true;
+        case Op::Swap:          effect = { 2, 2, 0, false }; return true;
+            
+        // The index is checked against the stack when it runs
+        case Op::Pick:
+        case Op::Tuck:          effect = { 1, 0, 0, false }; return true;
+        case Op::Pop:           effect = { 1, 0, 0, false }; return true;
+        case Op::At:            effect = { 2, 1, 0, false }; return true;
+        case Op::AtPut:
+        case Op::Insert:        effect = { 3, 0, 0, false }; return true;
+        case Op::Lt:
+        case Op::Le:
+        case Op::Eq:
+        case Op::Ne:
+        case Op::Ge:
+        case Op::Gt:            effect = { 2, 1, 0, false }; return true;
+        case Op::Inc:
+        case Op::Dec:           effect = { 1, 1, 0, false }; return true;
+        case Op::Print:
+        case Op::Println:       effect = { 1, 0, 0, false }; return true;
+        case Op::Cat:           effect = { 2, 1, 0, false }; return true;
+        case Op::CurrentTime:   effect = { 0, 1, 0, false }; return true;
+        case Op::Delay:         effect = { 1, 0, 0, false }; return true;
+            
+        // The constructor is native code which can use the stack
+        case Op::New:           effect = { 1, 1, 0, true }; return true;
+        case Op::Loop:          effect = { 1, 0, 0, true }; return true;
+        case Op::Break:         effect = { 0, 0, 0, true }; return true;
+        case Op::If:            effect = { 2, 0, 0, true }; return true;
+        
+        // S stays under the lists of a for until the loop ends
+        case Op::For:           effect = { 4, 0, 0, true }; return true;
+        case Op::While:         effect = { 2, 0, 0, true }; return true;
+        case Op::Fold:          effect = { 3, 0, 0, true }; return true;
+        case Op::Map:
+        case Op::Filter:        effect = { 2, 0, 0, true }; return true;
+        case Op::AddInt8:       effect = { 1, 1, 1, false }; return true;
+        case Op::ArithInt8:     effect = { 1, 1, 2, false }; return true;
+        case Op::DupCmpInt8:    effect = { 1, 2, 2, false }; return true;
+        case Op::DupCmpLoad:    effect = { 1, 2, 3, false }; return true;
+        case Op::LoadLoadProp:  effect = { 0, 1, 4, false }; return true;
+        case Op::BreakIf:       effect = { 1, 0, 0, false }; return true;
+        case Op::BreakIfCmpInt8: effect = { 1, 1, 2, false }; return true;
+        case Op::Check:         effect = { 0, 0, 1, false }; return true;
+        case Op::UnknownVerb:
+        case Op::UnknownToken:  effect = { 0, 0, 2, true }; return true;
+        case Op::End:           effect = { 0, 0, 0, false }; return true;
+        default: return false;
+    }
+}
+
+void Code::insertChecks()
+{
+    // Track the depth of the stack relative to the start of the current
+    // run and the most values it has needed from below that
+    m8r::Vector<uint8_t> code;
+    int32_t runStart = 0;
+    int32_t depth = 0;
+    int32_t needs = 0;
+    bool changed = false;
+    
+    auto endRun = [&](int32_t end) {
+        if (needs) {
+            code.push_back(uint8_t(Op::Check));
+            code.push_back(uint8_t(needs));
+            changed = true;
+        }
+        for (int32_t i = runStart; i < end; ++i) {
+            code.push_back(_code[i]);
+        }
+        runStart = end;
+        depth = 0;
+        needs = 0;
+    };
+    
+    for (int32_t pc = 0; pc < int32_t(_code.size()); ) {
+        Effect e;
+        bool valid = effect(static_cast<Op>(_code[pc]), e);
+        assert(valid);
+        (void) valid;
+        
+        // A run needing more than a Check can hold is split
+        if (std::max(needs, e.inputs - depth) > std::numeric_limits<uint8_t>::max()) {
+            endRun(pc);
+        }
+        needs = std::max(needs, e.inputs - depth);
+        depth += e.outputs - e.inputs;
+        pc += 1 + e.operands;
+        
+        if (e.opaque) {
+            endRun(pc);
+        }
+    }
+    endRun(int32_t(_code.size()));
+    
+    if (changed) {
+        _code.swap(code);
+    }
+}
+
+bool Code::verify(uint16_t globalCount)
+{
+    // Follow the least number of values the stack can have. Nothing is
+    // known at the start or after an opaque instruction except what a
+    // Check makes sure of. run is the depth relative to the start of the
+    // current run
+    int32_t depth = 0;
+    int32_t run = 0;
+    int32_t growth = 0;
+    _globalsUsed = 0;
+    for (int32_t pc = 0; pc < _size; ) {
+        Op op = static_cast<Op>(_begin[pc]);
+        Effect e;
+        if (!effect(op, e) || pc + 1 + e.operands > _size) {
+            return false;
+        }
+        
+        const uint8_t* operands = _begin + pc + 1;
+        uint16_t operand16 = (e.operands > 1) ? (uint16_t(operands[0]) | (uint16_t(operands[1]) << 8)) : 0;
+        switch(op) {
+            case Op::PushConst:
+                if (operands[0] >= _constants.size()) {
+                    return false;
+                }
+                break;
+            case Op::PushConstWide:
+                if (operand16 >= _constants.size()) {
+                    return false;
+                }
+                break;
+            case Op::Load:
+            case Op::Store:
+            case Op::Exec:
+            case Op::LoadLoadProp:
+                if (operand16 >= globalCount) {
+                    return false;
+                }
+                _globalsUsed = std::max(_globalsUsed, uint32_t(operand16) + 1);
+                break;
+            case Op::DupCmpLoad: {
+                uint16_t slot = uint16_t(operands[1]) | (uint16_t(operands[2]) << 8);
+                if (slot >= globalCount) {
+                    return false;
+                }
+                _globalsUsed = std::max(_globalsUsed, uint32_t(slot) + 1);
+                break;
+            }
+            case Op::Check:
+                if (pc == 0) {
+                    _needs = operands[0];
+                }
+                depth = std::max(depth, int32_t(operands[0]));
+                break;
+            case Op::End:
+                if (pc + 1 != _size) {
+                    return false;
+                }
+                _endDepth = uint8_t(std::min(depth, int32_t(std::numeric_limits<uint8_t>::max())));
+                _growth = uint32_t(growth);
+                return true;
+            default:
+                break;
+        }
+        
+        if (depth < e.inputs) {
+            return false;
+        }
+        depth = e.opaque ? 0 : (depth + e.outputs - e.inputs);
+        run = e.opaque ? 0 : (run + e.outputs - e.inputs);
+        growth = std::max(growth, run);
+        pc += 1 + e.operands;
+    }
+    return false;
+}
+
+const char* Code::opName(Op op)
+{
+    static const char* names[] = {
+#define MARLY_OP_NAME(name) #name,
+        MARLY_OPS(MARLY_OP_NAME)
+#undef MARLY_OP_NAME
+    };
+    return (op < Op::Count) ? names[uint8_t(op)] : "<invalid>";
+}
+
+void CodeBuilder::emitValue(const Value& value)
+{
+    if (value.isBuiltInVerb()) {
+        emitBuiltInVerb(value.builtInVerb());
+        return;
+    }
+    
+    switch(value.type()) {
+        case Value::Type::Bool:
+            emit(value.boolean() ? Op::PushTrue : Op::PushFalse);
+            return;
+        case Value::Type::Int:
+            if (value.integer() >= -128 && value.integer() <= 127) {
+                emit(Op::PushInt8, uint8_t(int8_t(value.integer())));
+                return;
+            }
+            break;
+        case Value::Type::Load: emit(Op::Load, uint16_t(value.integer())); return;
+        case Value::Type::Store: emit(Op::Store, uint16_t(value.integer())); return;
+        case Value::Type::Exec: emit(Op::Exec, uint16_t(value.integer())); return;
+        case Value::Type::LoadProp: emit(Op::LoadProp, uint16_t(value.integer())); return;
+        case Value::Type::StoreProp: emit(Op::StoreProp, uint16_t(value.integer())); return;
+        case Value::Type::ExecProp: emit(Op::ExecProp, uint16_t(value.integer())); return;
+        case Value::Type::Verb: emit(Op::CallVerb, uint16_t(value.integer())); return;
+        case Value::Type::TokenVerb: emitTokenVerb(static_cast<m8r::Token>(value.integer())); return;
+        default:
+            break;
+    }
+    
+    // Everything else is pushed from the constant pool
+    uint16_t index = uint16_t(_constants.size());
+    _constants.push_back(value);
+    if (index <= 0xff) {
+        emit(Op::PushConst, uint8_t(index));
+    } else {
+        emit(Op::PushConstWide, index);
+    }
+}
+
+Op Code::builtInVerbOp(SA verb)
+{
+    switch(verb) {
+        case SA::dup: return Op::Dup;
+        case SA::swap: return Op::Swap;
+        case SA::pick: return Op::Pick;
+        case SA::tuck: return Op::Tuck;
+        case SA::pop: return Op::Pop;
+        case SA::at: return Op::At;
+        case SA::atput: return Op::AtPut;
+        case SA::insert: return Op::Insert;
+        case SA::lt: return Op::Lt;
+        case SA::le: return Op::Le;
+        case SA::eq: return Op::Eq;
+        case SA::ne: return Op::Ne;
+        case SA::ge: return Op::Ge;
+        case SA::gt: return Op::Gt;
+        case SA::inc: return Op::Inc;
+        case SA::dec: return Op::Dec;
+        case SA::print: return Op::Print;
+        case SA::println: return Op::Println;
+        case SA::cat: return Op::Cat;
+        case SA::currentTime: return Op::CurrentTime;
+        case SA::delay: return Op::Delay;
+        case SA::new$: return Op::New;
+        case SA::loop: return Op::Loop;
+        case SA::break$: return Op::Break;
+        case SA::if$: return Op::If;
+        case SA::for$: return Op::For;
+        case SA::while$: return Op::While;
+        case SA::fold: return Op::Fold;
+        case SA::map: return Op::Map;
+        case SA::filter: return Op::Filter;
+        default: return Op::UnknownVerb;
+    }
+}
+
+Op Code::tokenVerbOp(m8r::Token token)
+{
+    switch(token) {
+        case m8r::Token::Plus: return Op::Add;
+        case m8r::Token::Minus: return Op::Sub;
+        case m8r::Token::Star: return Op::Mul;
+        case m8r::Token::Slash: return Op::Div;
+        case m8r::Token::Percent: return Op::Mod;
+        default: return Op::UnknownToken;
+    }
+}
+
+void CodeBuilder::emitBuiltInVerb(SA verb)
+{
+    Op op = Code::builtInVerbOp(verb);
+    if (op == Op::UnknownVerb) {
+        emit(op, uint16_t(verb));
+    } else {
+        emit(op);
+    }
+}
+
+void CodeBuilder::emitTokenVerb(m8r::Token token)
+{
+    Op op = Code::tokenVerbOp(token);
+    if (op == Op::UnknownToken) {
+        emit(op, uint16_t(token));
+    } else {
+        emit(op);
+    }
+}
+
+bool CodeBuilder::isBreakList(uint32_t i) const
+{
+    uint16_t index;
+    switch(op(i)) {
+        case Op::PushConst: index = uint8(i); break;
+        case Op::PushConstWide: index = uint16(i); break;
+        default: return false;
+    }
+    
+    const Value& value = _constants[index];
+    if (value.type() != Value::Type::List || value.list()->size() != 1) {
+        return false;
+    }
+    const Value& elt = value.list()->at(0);
+    return elt.isBuiltInVerb() && elt.builtInVerb() == SA::break$;
+}
+
+void CodeBuilder::fuse()
+{
+    Op last = op(0);
+    
+    if (isArithmetic(last) && op(1) == Op::PushInt8) {
+        // 1 +
+        int8_t value = int8(1);
+        rewind(2);
+        if (last == Op::Add) {
+            emit(Op::AddInt8, uint8_t(value));
+        } else {
+            emit(Op::ArithInt8, last, value);
+        }
+        return;
+    }
+    
+    if (isComparison(last) && op(2) == Op::Dup) {
+        if (op(1) == Op::PushInt8) {
+            // dup 10 ge
+            int8_t value = int8(1);
+            rewind(3);
+            emit(Op::DupCmpInt8, last, value);
+            return;
+        }
+        if (op(1) == Op::Load) {
+            // dup $n lt
+            uint16_t atom = uint16(1);
+            rewind(3);
+            emit(Op::DupCmpLoad, static_cast<uint8_t>(last));
+            appendUInt16(atom);
+            return;
+        }
+        return;
+    }
+    
+    if (last == Op::LoadProp && op(1) == Op::Load) {
+        // $x .prop
+        uint16_t prop = uint16(0);
+        uint16_t atom = uint16(1);
+        rewind(2);
+        emit(Op::LoadLoadProp, atom);
+        appendUInt16(prop);
+        return;
+    }
+    
+    if (last == Op::If && isBreakList(1)) {
+        // [break] if. Drop the List from the constant pool if nothing else follows it
+        uint16_t index = (op(1) == Op::PushConst) ? uint8(1) : uint16(1);
+        if (index == _constants.size() - 1) {
+            _constants.resize(index);
+        }
+        rewind(2);
+        
+        if (op(0) == Op::DupCmpInt8) {
+            // dup 10 ge [break] if
+            Op cmp = static_cast<Op>(uint8(0));
+            int8_t value = int8(0, 2);
+            rewind(1);
+            emit(Op::BreakIfCmpInt8, cmp, value);
+        } else {
+            emit(Op::BreakIf);
+        }
+        return;
+    }
+}
+
+List::~List()
+{
+}
+
+const m8r::SharedPtr<Code>& List::code() const
+{
+    if (!_code) {
+        _code.reset(new Code(*this));
+    }
+    return _code;
+}
+
+void List::setCode(Code* code)
+{
+    _code.reset(code);
+}
+
+void List::invalidateCode()
+{
+    _code.reset();
+    _sharedCode = nullptr;
+}
+
+List* List::clone() const
+{
+    List* list = new List();
+    static_cast<ValueVector&>(*list) = *this;
+    list->_sharedCode = frozen() ? code().get() : _sharedCode;
+    return list;
+}
+
+CodeRef::CodeRef(const List* list)
+{
+    if (list->frozen()) {
+        _code = list->code().get();
+    } else if (list->sharedCode()) {
+        _code = list->sharedCode();
+    } else {
+        _owner = list->code();
+        _code = _owner.get();
+    }
+}
@@ -0,0 +1,252 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "Containers.h"
+#include "MarlyValue.h"
+#include "Scanner.h"
+#include "SharedPtr.h"
+
+#include <cmath>
+
+namespace marly {
+
+// Opcodes of a compiled List. Each instruction is a one byte opcode
+// optionally followed by operands. 16 bit operands are little endian.
+//
+// The list is an X-macro so the interpreter can build its dispatch table
+// in the same order as the enum.
+#define MARLY_OPS(OP) \
+    /* Literals */ \
+    OP(PushFalse) OP(PushTrue) \
+    OP(PushInt8)            /* <int8> value */ \
+    OP(PushConst)           /* <uint8> index into constant pool */ \
+    OP(PushConstWide)       /* <uint16> index into constant pool */ \
+    \
+    /* Var and property access. Operand is a <uint16> Atom */ \
+    OP(Load) OP(Store) OP(Exec) OP(LoadProp) OP(StoreProp) OP(ExecProp) \
+    \
+    OP(CallVerb)            /* <uint16> index into the verb table */ \
+    \
+    /* Arithmetic operators */ \
+    OP(Add) OP(Sub) OP(Mul) OP(Div) OP(Mod) \
+    \
+    /* Built-in verbs */ \
+    OP(Dup) OP(Swap) OP(Pick) OP(Tuck) OP(Pop) OP(At) OP(AtPut) OP(Insert) \
+    OP(Lt) OP(Le) OP(Eq) OP(Ne) OP(Ge) OP(Gt) \
+    OP(Inc) OP(Dec) \
+    OP(Print) OP(Println) OP(Cat) \
+    OP(CurrentTime) OP(Delay) OP(New) \
+    OP(Loop) OP(Break) OP(If) \
+    OP(For) OP(While) OP(Fold) OP(Map) OP(Filter) \
+    \
+    /* Superinstructions, fused by CodeBuilder from common sequences. */ \
+    /* <cmp> is the Op of a comparison, <arith> the Op of an operator */ \
+    OP(AddInt8)             /* <int8>: PushInt8 Add */ \
+    OP(ArithInt8)           /* <arith> <int8>: PushInt8 <arith> */ \
+    OP(DupCmpInt8)          /* <cmp> <int8>: Dup PushInt8 <cmp> */ \
+    OP(DupCmpLoad)          /* <cmp> <uint16>: Dup Load <cmp> */ \
+    OP(LoadLoadProp)        /* <uint16> <uint16>: Load LoadProp */ \
+    OP(BreakIf)             /* PushConst [break] If */ \
+    OP(BreakIfCmpInt8)      /* <cmp> <int8>: DupCmpInt8 BreakIf */ \
+    \
+    /* <uint8> fail unless the stack has at least this many values. */ \
+    /* Added by the verifier, see Code::insertChecks() */ \
+    OP(Check) \
+    \
+    /* Verbs and tokens with no implementation. Operand is the <uint16> */ \
+    /* SA or Token, used to report the error at runtime */ \
+    OP(UnknownVerb) OP(UnknownToken) \
+    \
+    /* Last instruction of every Code */ \
+    OP(End) \
+
+enum class Op : uint8_t {
+#define MARLY_OP_ENUM(name) name,
+    MARLY_OPS(MARLY_OP_ENUM)
+#undef MARLY_OP_ENUM
+    Count
+};
+
+// Arithmetic kernels. When both operands are Int the operation is done in
+// 32 bit integer arithmetic so counters never turn into floats. Overflow
+// wraps in two's complement and division truncates toward zero. Returns
+// false on integer divide by zero. Any other combination of operands is
+// done in float. Shared by the interpreter and the Optimizer.
+inline bool intArith(Op op, int32_t lhs, int32_t rhs, int32_t& result)
+{
+    switch(op) {
+        case Op::Add: result = int32_t(uint32_t(lhs) + uint32_t(rhs)); return true;
+        case Op::Sub: result = int32_t(uint32_t(lhs) - uint32_t(rhs)); return true;
+        case Op::Mul: result = int32_t(uint32_t(lhs) * uint32_t(rhs)); return true;
+        case Op::Div:
+        case Op::Mod:
+            if (rhs == 0) {
+                return false;
+            }
+            
+            // INT32_MIN / -1 overflows
+            if (rhs == -1) {
+                result = (op == Op::Div) ? int32_t(0 - uint32_t(lhs)) : 0;
+            } else {
+                result = (op == Op::Div) ? (lhs / rhs) : (lhs % rhs);
+            }
+            return true;
+        default:
+            result = 0;
+            return true;
+    }
+}
+
+inline float floatArith(Op op, float lhs, float rhs)
+{
+    switch(op) {
+        case Op::Add: return lhs + rhs;
+        case Op::Sub: return lhs - rhs;
+        case Op::Mul: return lhs * rhs;
+        case Op::Div: return lhs / rhs;
+        case Op::Mod: return fmodf(lhs, rhs);
+        default: return 0;
+    }
+}
+
+template<typename T>
+inline bool compare(Op op, T lhs, T rhs)
+{
+    switch(op) {
+        case Op::Lt: return lhs < rhs;
+        case Op::Le: return lhs <= rhs;
+        case Op::Eq: return lhs == rhs;
+        case Op::Ne: return lhs != rhs;
+        case Op::Ge: return lhs >= rhs;
+        case Op::Gt: return lhs > rhs;
+        default: return false;
+    }
+}
+
+// Compiled form of a List. Every element of the List is lowered to a
+// single instruction. Values which can't be encoded inline go in the
+// constant pool. The code is always terminated with Op::End so the
+// interpreter never has to check for running off the end.
+//
+// The interpreter doesn't check for stack underflow. Instead the stack
+// effect of each instruction is known, so the verifier can tell how many
+// values a run of instructions takes from below where it starts. A run
+// ends at an instruction which runs other code, such as a call or a loop,
+// since the stack can be any depth after it. A Check is put in front of
+// each run which needs values, so a List which only uses values it
+// pushes itself runs with no checks at all.
+class Code : public m8r::Shared
+{
+    friend class CodeBuilder;
+    friend class Program;
+    
+public:
+    Code(const List&);
+
+    int32_t size() const { return _size; }
+    const uint8_t* begin() const { return _begin; }
+    const uint8_t* end() const { return _begin + _size; }
+
+    // Decode the item at pc and advance pc past it
+    static Op op(const uint8_t*& pc) { return static_cast<Op>(*pc++); }
+    static uint8_t uint8(const uint8_t*& pc) { return *pc++; }
+    static int8_t int8(const uint8_t*& pc) { return static_cast<int8_t>(*pc++); }
+    static uint16_t uint16(const uint8_t*& pc)
+    {
+        uint16_t value = uint16_t(pc[0]) | (uint16_t(pc[1]) << 8);
+        pc += 2;
+        return value;
+    }
+
+    const Value& constant(uint16_t index) const { return _constants[index]; }
+    uint16_t constantCount() const { return uint16_t(_constants.size()); }
+    
+    // Values the code needs on the stack when it starts, and the number
+    // it is known to leave there when it reaches End
+    uint8_t needs() const { return _needs; }
+    uint8_t endDepth() const { return _endDepth; }
+    
+    // The most values the code pushes above where the stack was when it
+    // started or when the last thing it called returned
+    uint32_t growth() const { return _growth; }
+    
+    // Where to start when the stack is known to have at least depth
+    // values. Past the Check at the start if that makes it pointless
+    const uint8_t* start(uint32_t depth) const { return (_needs && depth >= _needs) ? _begin + 2 : _begin; }
+    
+    // Code compiled from a List which isn't frozen is only verified when
+    // it runs, since its vars may not be in the Program running it
+    bool runnable(uint16_t globalCount) const { return _valid && _globalsUsed <= globalCount; }
+    
+    static const char* opName(Op);
+    
+    // The Op a built-in verb or operator is lowered to. UnknownVerb or
+    // UnknownToken if there is none
+    static Op builtInVerbOp(SA);
+    static Op tokenVerbOp(m8r::Token);
+
+private:
+    // Code in a Program image, which is run where it is
+    Code(const uint8_t* code, int32_t size) : _begin(code), _size(size) { }
+    
+    // Values taken and left on the stack by an instruction, and the size
+    // of its operands. An opaque instruction runs other code, so after it
+    // the depth of the stack is unknown. False for an invalid Op.
+    struct Effect
+    {
+        uint8_t inputs;
+        uint8_t outputs;
+        uint8_t operands;
+        bool opaque;
+    };
+    
+    static bool effect(Op, Effect&);
+    
+    // Put a Check in front of each run of instructions which takes values
+    // it didn't push
+    void insertChecks();
+    
+    // Make sure every instruction is valid and the stack can't underflow.
+    // Sets _needs, _endDepth, _growth and _globalsUsed. Code from an
+    // image is never trusted
+    bool verify(uint16_t globalCount);
+    
+    // Empty for Code in an image
+    m8r::Vector<uint8_t> _code;
+    ValueVector _constants;
+    const uint8_t* _begin = nullptr;
+    int32_t _size = 0;
+    uint8_t _needs = 0;
+    uint8_t _endDepth = 0;
+    uint32_t _growth = 0;
+    uint32_t _globalsUsed = 0;
+    bool _valid = true;
+};
+
+// The Code of a List, for running it. Holds a reference to the Code so it
+// stays valid if the List is changed while it runs. Code of a frozen List
+// lives as long as its Program and is shared between threads, so it is
+// not referenced.
+class CodeRef
+{
+public:
+    CodeRef() { }
+    CodeRef(const List*);
+    
+    const Code* get() const { return _code; }
+    const Code* operator->() const { return _code; }
+
+private:
+    const Code* _code = nullptr;
+    m8r::SharedPtr<Code> _owner;
+};
+
+}
@@ -0,0 +1,297 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "MarlyKernel.h"
+
+using namespace marly;
+
+static bool isArith(Op op) { return op >= Op::Add && op <= Op::Mod; }
+static bool isCompare(Op op) { return op >= Op::Lt && op <= Op::Gt; }
+
+template<Op O> static inline int32_t arith(int32_t lhs, int32_t rhs)
+{
+    int32_t result = 0;
+    intArith(O, lhs, rhs, result);
+    return result;
+}
+
+template<Op O> static inline float arith(float lhs, float rhs) { return floatArith(O, lhs, rhs); }
+
+// The Op is a template argument so the switch in the interpreter's kernel
+// folds away, leaving a loop the compiler can vectorize
+template<Op O, typename T>
+static void step(T* values, uint8_t* flags, uint32_t n, bool self, T k)
+{
+    if (isCompare(O)) {
+        for (uint32_t i = 0; i < n; ++i) {
+            flags[i] = compare(O, values[i], k);
+        }
+    } else if (self) {
+        for (uint32_t i = 0; i < n; ++i) {
+            values[i] = arith<O>(values[i], values[i]);
+        }
+    } else {
+        for (uint32_t i = 0; i < n; ++i) {
+            values[i] = arith<O>(values[i], k);
+        }
+    }
+}
+
+template<Op O, typename T>
+static T reduce(const T* values, uint32_t n, T acc)
+{
+    for (uint32_t i = 0; i < n; ++i) {
+        acc = arith<O>(acc, values[i]);
+    }
+    return acc;
+}
+
+template<typename T>
+static T reduce(Op op, const T* values, uint32_t n, T acc)
+{
+    switch (op) {
+        case Op::Add: return reduce<Op::Add>(values, n, acc);
+        case Op::Sub: return reduce<Op::Sub>(values, n, acc);
+        default: return reduce<Op::Mul>(values, n, acc);
+    }
+}
+
+bool Kernel::compileUnary(const Code& code)
+{
+    _stepCount = 0;
+    _predicate = false;
+
+    // The only value it takes is the element
+    if (code.needs() > 1) {
+        return false;
+    }
+
+    const uint8_t* pc = code.start(1);
+    while (true) {
+        Op op = Code::op(pc);
+        if (op == Op::End) {
+            return _stepCount > 0;
+        }
+        if (_predicate || _stepCount == MaxSteps) {
+            return false;
+        }
+
+        Step step { Op::End, false, false, 0, 0 };
+        switch (op) {
+            case Op::AddInt8: step.op = Op::Add; step.i = Code::int8(pc); break;
+            case Op::ArithInt8: step.op = Code::op(pc); step.i = Code::int8(pc); break;
+            case Op::Inc: step.op = Op::Add; step.i = 1; break;
+            case Op::Dec: step.op = Op::Sub; step.i = 1; break;
+            case Op::Dup:
+                step.op = Code::op(pc);
+                if (step.op != Op::Add && step.op != Op::Mul) {
+                    return false;
+                }
+                step.self = true;
+                break;
+            case Op::PushInt8:
+                step.i = Code::int8(pc);
+                step.op = Code::op(pc);
+                break;
+            case Op::PushConst:
+            case Op::PushConstWide: {
+                const Value& k = code.constant((op == Op::PushConst) ? Code::uint8(pc) : Code::uint16(pc));
+                if (k.type() == Value::Type::Int) {
+                    step.i = k.integer();
+                } else if (k.type() == Value::Type::Float) {
+                    step.f = k.flt();
+                    step.isFloat = true;
+                } else {
+                    return false;
+                }
+                step.op = Code::op(pc);
+                break;
+            }
+            default:
+                return false;
+        }
+
+        if (isCompare(step.op)) {
+            _predicate = true;
+        } else if (!isArith(step.op)) {
+            return false;
+        }
+        _steps[_stepCount++] = step;
+    }
+}
+
+bool Kernel::compileFold(const Code& code)
+{
+    // Takes the accumulated value and the element
+    if (code.needs() > 2) {
+        return false;
+    }
+
+    const uint8_t* pc = code.start(2);
+    Op op = Code::op(pc);
+    if ((op != Op::Add && op != Op::Sub && op != Op::Mul) || Code::op(pc) != Op::End) {
+        return false;
+    }
+    _foldOp = op;
+    return true;
+}
+
+Kernel::Type Kernel::load(const List& source)
+{
+    if (source.empty()) {
+        return Type::None;
+    }
+
+    uint32_t n = uint32_t(source.size());
+    switch (source[0].type()) {
+        case Value::Type::Int:
+            _ints.resize(n);
+            for (uint32_t i = 0; i < n; ++i) {
+                if (source[i].type() != Value::Type::Int) {
+                    return Type::None;
+                }
+                _ints[i] = source[i].integer();
+            }
+            return Type::Int;
+        case Value::Type::Float:
+            _floats.resize(n);
+            for (uint32_t i = 0; i < n; ++i) {
+                if (source[i].type() != Value::Type::Float) {
+                    return Type::None;
+                }
+                _floats[i] = source[i].flt();
+            }
+            return Type::Float;
+        default:
+            return Type::None;
+    }
+}
+
+template<typename T>
+void Kernel::run(T* values, uint32_t n)
+{
+    uint8_t* flags = _predicate ? &_flags[0] : nullptr;
+    for (uint32_t s = 0; s < _stepCount; ++s) {
+        const Step& st = _steps[s];
+        T k = st.isFloat ? T(st.f) : T(st.i);
+        switch (st.op) {
+            case Op::Add: step<Op::Add>(values, flags, n, st.self, k); break;
+            case Op::Sub: step<Op::Sub>(values, flags, n, st.self, k); break;
+            case Op::Mul: step<Op::Mul>(values, flags, n, st.self, k); break;
+            case Op::Div: step<Op::Div>(values, flags, n, st.self, k); break;
+            case Op::Mod: step<Op::Mod>(values, flags, n, st.self, k); break;
+            case Op::Lt: step<Op::Lt>(values, flags, n, st.self, k); break;
+            case Op::Le: step<Op::Le>(values, flags, n, st.self, k); break;
+            case Op::Eq: step<Op::Eq>(values, flags, n, st.self, k); break;
+            case Op::Ne: step<Op::Ne>(values, flags, n, st.self, k); break;
+            case Op::Ge: step<Op::Ge>(values, flags, n, st.self, k); break;
+            case Op::Gt: step<Op::Gt>(values, flags, n, st.self, k); break;
+            default: break;
+        }
+    }
+}
+
+bool Kernel::run(Type type)
+{
+    if (type == Type::Int) {
+        // Int elements stay Int only with Int literals. Leave divide by
+        // zero to the interpreter for its error
+        for (uint32_t s = 0; s < _stepCount; ++s) {
+            const Step& st = _steps[s];
+            if (st.isFloat || ((st.op == Op::Div || st.op == Op::Mod) && st.i == 0)) {
+                return false;
+            }
+        }
+    }
+
+    uint32_t n = uint32_t((type == Type::Int) ? _ints.size() : _floats.size());
+    if (_predicate) {
+        _flags.resize(n);
+    }
+    if (type == Type::Int) {
+        run(&_ints[0], n);
+    } else {
+        run(&_floats[0], n);
+    }
+    return true;
+}
+
+bool Kernel::pass(Type type, uint32_t i) const
+{
+    if (_predicate) {
+        return _flags[i];
+    }
+    return (type == Type::Int) ? (_ints[i] != 0) : (_floats[i] != 0);
+}
+
+bool Kernel::map(const List& source, List& result)
+{
+    Type type = load(source);
+    if (type == Type::None || !run(type)) {
+        return false;
+    }
+
+    uint32_t n = uint32_t(source.size());
+    result.reserve(n);
+    for (uint32_t i = 0; i < n; ++i) {
+        if (_predicate) {
+            result.push_back(Value(_flags[i] != 0));
+        } else if (type == Type::Int) {
+            result.push_back(Value(_ints[i]));
+        } else {
+            result.push_back(Value(_floats[i]));
+        }
+    }
+    return true;
+}
+
+bool Kernel::filter(const List& source, List& result)
+{
+    Type type = load(source);
+    if (type == Type::None || !run(type)) {
+        return false;
+    }
+
+    uint32_t n = uint32_t(source.size());
+    for (uint32_t i = 0; i < n; ++i) {
+        if (pass(type, i)) {
+            result.push_back(source[i]);
+        }
+    }
+    return true;
+}
+
+bool Kernel::fold(const List& source, const Value& initial, Value& result)
+{
+    bool intInitial = initial.type() == Value::Type::Int;
+    if (!intInitial && initial.type() != Value::Type::Float) {
+        return false;
+    }
+
+    Type type = load(source);
+    if (type == Type::None) {
+        return false;
+    }
+
+    uint32_t n = uint32_t(source.size());
+    if (type == Type::Int && intInitial) {
+        result = Value(reduce(_foldOp, &_ints[0], n, initial.integer()));
+        return true;
+    }
+
+    // Once either side is Float the rest is done in float
+    if (type == Type::Int) {
+        _floats.resize(n);
+        for (uint32_t i = 0; i < n; ++i) {
+            _floats[i] = float(_ints[i]);
+        }
+    }
+    result = Value(reduce(_foldOp, &_floats[0], n, initial.flt()));
+    return true;
+}
@@ -0,0 +1,83 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "Containers.h"
+#include "MarlyCode.h"
+#include "MarlyValue.h"
+
+namespace marly {
+
+// Runs map, filter and fold natively when the List they run is a simple
+// arithmetic kernel and the source List is all Int or all Float. The
+// elements are copied out to a plain array and each step runs over all of
+// it in a loop the compiler can vectorize. A kernel is a series of steps
+// on the element:
+//
+//      <k> <arith>     x = x <arith> k, k is an Int or Float literal
+//      inc, dec        x = x + 1, x = x - 1
+//      dup +, dup *    x = x + x, x = x * x
+//      <k> <cmp>       x = x <cmp> k, only as the last step
+//
+// The List of a fold must be just +, - or *. The results are exactly what
+// running the List gives. Anything else, including an Int kernel which
+// divides by 0 or has a Float literal, is left to the interpreter. A
+// kernel runs to the end without a safe point, so events and the slice
+// budget wait until it is done.
+class Kernel
+{
+public:
+    static constexpr uint32_t MaxSteps = 8;
+
+    // False if the code isn't a kernel
+    bool compileUnary(const Code&);
+    bool compileFold(const Code&);
+
+    // False if the kernel can't run on source. The unary kernel is used
+    // by map and filter
+    bool map(const List& source, List& result);
+    bool filter(const List& source, List& result);
+    bool fold(const List& source, const Value& initial, Value& result);
+
+private:
+    struct Step
+    {
+        Op op;
+        bool self;      // dup <op>
+        bool isFloat;
+        int32_t i;
+        float f;
+    };
+
+    enum class Type { None, Int, Float };
+
+    // Copy source to _ints or _floats. None unless every element has the
+    // same numeric type
+    Type load(const List& source);
+
+    // Run the steps over _ints or _floats. A comparison leaves its result
+    // in _flags
+    bool run(Type);
+    template<typename T> void run(T* values, uint32_t n);
+
+    bool pass(Type, uint32_t i) const;
+
+    Step _steps[MaxSteps];
+    uint32_t _stepCount = 0;
+    bool _predicate = false;
+    Op _foldOp = Op::End;
+
+    // Kept between runs, so they stop allocating once they are big enough
+    m8r::Vector<int32_t> _ints;
+    m8r::Vector<float> _floats;
+    m8r::Vector<uint8_t> _flags;
+};
+
+}
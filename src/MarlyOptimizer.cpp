@@ -0,0 +1,337 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "MarlyOptimizer.h"
+
+using namespace marly;
+
+void Optimizer::optimize(const Value& root)
+{
+    List* list = root.list();
+    if (!list) {
+        return;
+    }
+
+    // Vars are counted before folding, to tell which Lists are run, and
+    // again after, so the size of a List reflects what would be inlined
+    _vars.clear();
+    _vars.resize(_program.globalCount());
+    countVars(*list);
+    fold(*list);
+
+    _vars.clear();
+    _vars.resize(_program.globalCount());
+    countVars(*list);
+    inlineCalls(*list);
+}
+
+Op Optimizer::op(const Value& value)
+{
+    if (value.isBuiltInVerb()) {
+        return Code::builtInVerbOp(value.builtInVerb());
+    }
+    if (value.type() == Value::Type::TokenVerb) {
+        return Code::tokenVerbOp(static_cast<m8r::Token>(value.integer()));
+    }
+    return Op::Count;
+}
+
+bool Optimizer::isCode(const List& list, size_t i) const
+{
+    // Find what takes the List. It may be one of several Lists before
+    // a loop
+    size_t next = i + 1;
+    while (next < list.size() && list[next].type() == Value::Type::List) {
+        ++next;
+    }
+    if (next == list.size()) {
+        return false;
+    }
+
+    const Value& user = list[next];
+    if (user.type() == Value::Type::Store) {
+        return next == i + 1 && _vars[user.integer()].loads == 0;
+    }
+
+    size_t lists;
+    switch (op(user)) {
+        case Op::If:
+        case Op::Loop:
+        case Op::Fold:
+        case Op::Map:
+        case Op::Filter: lists = 1; break;
+        case Op::While: lists = 2; break;
+        case Op::For: lists = 3; break;
+        default: return false;
+    }
+    return next - i <= lists;
+}
+
+void Optimizer::fold(List& list)
+{
+    ValueVector out;
+    for (size_t i = 0; i < list.size(); ++i) {
+        const Value& value = list[i];
+        if (value.type() == Value::Type::List && isCode(list, i)) {
+            fold(*value.list());
+        }
+        push(out, value);
+    }
+
+    if (out.size() != list.size()) {
+        static_cast<ValueVector&>(list) = out;
+        list.invalidateCode();
+    }
+}
+
+void Optimizer::push(ValueVector& out, const Value& value)
+{
+    out.push_back(value);
+    while (reduce(out)) { }
+}
+
+bool Optimizer::reduce(ValueVector& out)
+{
+    // Try to replace an operator at the end of out, and the literals
+    // before it, with its result
+    size_t size = out.size();
+    if (size < 2) {
+        return false;
+    }
+
+    Op o = op(out[size - 1]);
+    const Value& a = out[size - 2];
+    Value result;
+    size_t operands;
+
+    switch (o) {
+        case Op::Inc:
+        case Op::Dec: {
+            if (!isNumber(a)) {
+                return false;
+            }
+            int32_t delta = (o == Op::Inc) ? 1 : -1;
+            result = (a.type() == Value::Type::Int) ? Value(int32_t(uint32_t(a.integer()) + uint32_t(delta))) : Value(a.flt() + delta);
+            operands = 1;
+            break;
+        }
+        case Op::Add:
+        case Op::Sub:
+        case Op::Mul:
+        case Op::Div:
+        case Op::Mod:
+        case Op::Lt:
+        case Op::Le:
+        case Op::Eq:
+        case Op::Ne:
+        case Op::Ge:
+        case Op::Gt: {
+            if (size < 3 || !isNumber(a) || !isNumber(out[size - 3])) {
+                return false;
+            }
+            const Value& lhs = out[size - 3];
+            bool ints = lhs.type() == Value::Type::Int && a.type() == Value::Type::Int;
+            if (o >= Op::Lt) {
+                result = Value(ints ? compare(o, lhs.integer(), a.integer()) : compare(o, lhs.flt(), a.flt()));
+            } else if (ints) {
+                int32_t i;
+                if (!intArith(o, lhs.integer(), a.integer(), i)) {
+                    return false;
+                }
+                result = Value(i);
+            } else {
+                result = Value(floatArith(o, lhs.flt(), a.flt()));
+            }
+            operands = 2;
+            break;
+        }
+        case Op::Cat: {
+            if (size < 3 || !isScalar(a) || !isScalar(out[size - 3])) {
+                return false;
+            }
+            const Value& lhs = out[size - 3];
+            String left, right;
+            lhs.toString(left);
+            a.toString(right);
+            m8r::String s = left.string();
+            s += right.string();
+            result = Value(s.c_str());
+            operands = 2;
+            break;
+        }
+        case Op::If: {
+            if (size < 3 || a.type() != Value::Type::List || !isScalar(out[size - 3]) || out[size - 3].type() == Value::Type::String) {
+                return false;
+            }
+            const Value& condition = out[size - 3];
+
+            // The body is added to out one element at a time, so it can
+            // fold with what comes before it
+            Value body = a;
+            bool taken = condition.boolean();
+            out.resize(size - 3);
+            _stats.branches++;
+            if (taken) {
+                for (const Value& value : *body.list()) {
+                    push(out, value);
+                }
+            }
+            return true;
+        }
+        default:
+            return false;
+    }
+
+    out.resize(size - operands - 1);
+    out.push_back(result);
+    _stats.folded++;
+    return true;
+}
+
+void Optimizer::countVars(const List& list)
+{
+    for (size_t i = 0; i < list.size(); ++i) {
+        const Value& value = list[i];
+        switch (value.type()) {
+            case Value::Type::List:
+                countVars(*value.list());
+                break;
+            case Value::Type::Load:
+                _vars[value.integer()].loads++;
+                break;
+            case Value::Type::Store: {
+                // Only a List literal stored directly can be inlined
+                Var& var = _vars[value.integer()];
+                var.stores++;
+                var.body = (i > 0 && list[i - 1].type() == Value::Type::List) ? list[i - 1] : Value();
+                break;
+            }
+            default:
+                break;
+        }
+    }
+}
+
+bool Optimizer::canInline(uint16_t slot, const List& list) const
+{
+    for (const Value& value : list) {
+        if (value.type() == Value::Type::List && !canInline(slot, *value.list())) {
+            return false;
+        }
+        if (value.type() == Value::Type::Exec && value.integer() == slot) {
+            return false;
+        }
+        if (op(value) == Op::Break) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Optimizer::inlineCalls(List& list)
+{
+    bool changed = false;
+    ValueVector out;
+    for (size_t i = 0; i < list.size(); ++i) {
+        const Value& value = list[i];
+        if (value.type() == Value::Type::List && isCode(list, i)) {
+            inlineCalls(*value.list());
+        }
+
+        if (value.type() == Value::Type::Exec) {
+            uint16_t slot = uint16_t(value.integer());
+            const Var& var = _vars[slot];
+            const List* body = var.body.list();
+            if (var.stores == 1 && var.loads == 0 && body && body->size() <= MaxInlineSize && canInline(slot, *body)) {
+                for (const Value& element : *body) {
+                    push(out, element);
+                }
+                _stats.inlined++;
+                changed = true;
+                continue;
+            }
+        }
+        push(out, value);
+    }
+
+    if (changed || out.size() != list.size()) {
+        static_cast<ValueVector&>(list) = out;
+        list.invalidateCode();
+    }
+}
+
+m8r::String Optimizer::toString(const Program& program, const Value& root)
+{
+    m8r::String s;
+    toString(program, root, s, true);
+    return s;
+}
+
+void Optimizer::toString(const Program& program, const Value& value, m8r::String& s, bool root)
+{
+    if (value.isBuiltInVerb()) {
+        s += program.atomTable().stringFromAtom(SAtom(value.builtInVerb()));
+        return;
+    }
+
+    const char* prefix = nullptr;
+    switch (value.type()) {
+        case Value::Type::List:
+            // The root is split into lines after each store
+            if (!root) {
+                s += "[ ";
+            }
+            for (const Value& element : *value.list()) {
+                toString(program, element, s, false);
+                s += (root && element.type() == Value::Type::Store) ? "\n" : " ";
+            }
+            if (!root) {
+                s += "]";
+            } else {
+                s += "\n";
+            }
+            return;
+        case Value::Type::String: {
+            String str;
+            value.toString(str);
+            s += '"';
+            for (const char* p = str.string().c_str(); *p; ++p) {
+                switch (*p) {
+                    case '"': s += "\\\""; break;
+                    case '\\': s += "\\\\"; break;
+                    case '\n': s += "\\n"; break;
+                    default: s += *p; break;
+                }
+            }
+            s += '"';
+            return;
+        }
+        case Value::Type::Bool:
+        case Value::Type::Int:
+        case Value::Type::Float: {
+            String str;
+            value.toString(str);
+            s += str.string();
+            return;
+        }
+        case Value::Type::TokenVerb: s += char(value.integer()); return;
+        case Value::Type::Verb: s += m8r::String::format("<verb %d>", value.integer()); return;
+        case Value::Type::Load: prefix = "$"; break;
+        case Value::Type::Store: prefix = "@"; break;
+        case Value::Type::Exec: prefix = "~"; break;
+        case Value::Type::LoadProp: s += '.'; s += program.atomTable().stringFromAtom(m8r::Atom(uint16_t(value.integer()))); return;
+        case Value::Type::StoreProp: s += ':'; s += program.atomTable().stringFromAtom(m8r::Atom(uint16_t(value.integer()))); return;
+        case Value::Type::ExecProp: s += ','; s += program.atomTable().stringFromAtom(m8r::Atom(uint16_t(value.integer()))); return;
+        default: s += "<?>"; return;
+    }
+
+    // Vars are bound to slots
+    s += prefix;
+    s += program.atomTable().stringFromAtom(program.globalName(uint16_t(value.integer())));
+}
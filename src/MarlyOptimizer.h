@@ -0,0 +1,94 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "Containers.h"
+#include "MarlyCode.h"
+#include "MarlyProgram.h"
+#include "MarlyValue.h"
+
+namespace marly {
+
+// Rewrites the Lists of a Program after it is parsed, before it is
+// compiled. Lists have no jumps, so a run of literals followed by an
+// operator always has those literals as its operands. Only Lists which
+// are run are rewritten: the root, the List before if, loop, map, filter
+// or fold, the Lists before while and for, and a List stored in a var
+// which is never loaded with '$'. Any other List may be used as data, so
+// it is left as it is. The rewrites are:
+//
+//      Folding     Arithmetic, comparisons, inc and dec of Int and Float
+//                  literals, and cat of any two literals, using the same
+//                  kernels as the interpreter. Integer divide by zero is
+//                  left for the runtime error.
+//      Branches    'B [..] if' with a literal B is replaced by the body
+//                  of the List if B is true and removed if it is false.
+//      Inlining    '~f' is replaced by the elements of f when f is set
+//                  just once, to a List literal of at most MaxInlineSize
+//                  elements, and is never loaded with '$f'. Lists which
+//                  call themselves or contain a break are not inlined.
+//
+// The only differences in behavior are that running a function which is
+// inlined before the var is stored no longer fails, that a stack
+// underflow in an inlined List is reported where it was inlined, which
+// can be when the Program is loaded, and that the host sees the rewritten
+// List if it gets a var holding one.
+class Optimizer
+{
+public:
+    static constexpr uint32_t MaxInlineSize = 8;
+
+    struct Stats
+    {
+        uint32_t folded = 0;
+        uint32_t branches = 0;
+        uint32_t inlined = 0;
+    };
+
+    Optimizer(const Program& program) : _program(program) { }
+
+    void optimize(const Value& root);
+
+    const Stats& stats() const { return _stats; }
+
+    // Source form of a Program's List, to see what the optimizer did
+    static m8r::String toString(const Program&, const Value& root);
+
+private:
+    struct Var
+    {
+        uint32_t stores = 0;
+        uint32_t loads = 0;
+        Value body;
+    };
+
+    static Op op(const Value&);
+    static bool isNumber(const Value& value) { return value.type() == Value::Type::Int || value.type() == Value::Type::Float; }
+    static bool isScalar(const Value& value) { return isNumber(value) || value.type() == Value::Type::Bool || value.type() == Value::Type::String; }
+
+    // Whether the List at index i of a List which is run is run too
+    bool isCode(const List&, size_t i) const;
+
+    void fold(List&);
+    void push(ValueVector&, const Value&);
+    bool reduce(ValueVector&);
+
+    void countVars(const List&);
+    bool canInline(uint16_t slot, const List&) const;
+    void inlineCalls(List&);
+
+    static void toString(const Program&, const Value&, m8r::String&, bool root);
+
+    const Program& _program;
+    Stats _stats;
+    m8r::Vector<Var> _vars;
+};
+
+}
@@ -0,0 +1,110 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "MarlyPool.h"
+
+#include <cstdlib>
+#if MARLY_THREADS
+#include <mutex>
+#endif
+
+using namespace marly;
+
+Pool* Pool::_first = nullptr;
+
+#if MARLY_THREADS
+// Guards the list of pools, which threads add to as they start allocating
+static std::mutex& listMutex()
+{
+    static std::mutex mutex;
+    return mutex;
+}
+#endif
+
+Pool::Pool(const char* name, size_t blockSize, uint16_t blocksPerChunk, Stats& stats)
+    : _name(name)
+    , _blockSize((blockSize + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1))
+    , _blocksPerChunk(blocksPerChunk)
+    , _stats(stats)
+{
+#if MARLY_THREADS
+    std::lock_guard<std::mutex> lock(listMutex());
+#endif
+    if (!_stats.listed) {
+        _stats.listed = true;
+        _next = _first;
+        _first = this;
+    }
+}
+
+void Pool::forEach(const std::function<void(const Pool&)>& f)
+{
+#if MARLY_THREADS
+    std::lock_guard<std::mutex> lock(listMutex());
+#endif
+    for (const Pool* pool = _first; pool; pool = pool->_next) {
+        f(*pool);
+    }
+}
+
+void* Pool::alloc()
+{
+    if (!_free) {
+        addChunk();
+        if (!_free) {
+            return nullptr;
+        }
+    }
+    
+    FreeBlock* block = _free;
+    _free = block->next;
+    
+    _stats.allocations++;
+    int32_t live = ++_stats.live;
+#if MARLY_THREADS
+    int32_t peak = _stats.peakLive;
+    while (live > peak && !_stats.peakLive.compare_exchange_weak(peak, live)) { }
+#else
+    if (live > _stats.peakLive) {
+        _stats.peakLive = live;
+    }
+#endif
+    return block;
+}
+
+void Pool::free(void* p)
+{
+    if (!p) {
+        return;
+    }
+    
+    assert(_stats.live > 0);
+    FreeBlock* block = static_cast<FreeBlock*>(p);
+    block->next = _free;
+    _free = block;
+    
+    _stats.frees++;
+    _stats.live--;
+}
+
+void Pool::addChunk()
+{
+    uint8_t* chunk = static_cast<uint8_t*>(::malloc(_blockSize * _blocksPerChunk));
+    if (!chunk) {
+        return;
+    }
+    
+    // Thread the new blocks onto the free list in address order
+    for (int32_t i = _blocksPerChunk - 1; i >= 0; --i) {
+        FreeBlock* block = reinterpret_cast<FreeBlock*>(chunk + i * _blockSize);
+        block->next = _free;
+        _free = block;
+    }
+    _stats.chunks++;
+}
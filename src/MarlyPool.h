@@ -0,0 +1,160 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <new>
+
+// Set MARLY_POOL_ALLOC to 0 to allocate pooled objects from the general
+// heap, for instance to run under a memory checker
+#ifndef MARLY_POOL_ALLOC
+#define MARLY_POOL_ALLOC 1
+#endif
+
+// Set MARLY_THREADS to 1 on hosts to run programs on several threads with
+// ThreadPool. Each thread then allocates from its own set of pools.
+#ifndef MARLY_THREADS
+#define MARLY_THREADS 0
+#endif
+
+#if MARLY_THREADS
+#include <atomic>
+#endif
+
+namespace marly {
+
+// Allocator for fixed size blocks. Blocks are carved out of chunks taken
+// from the heap. Freed blocks go on a free list and chunks are never
+// returned, so a long running program keeps reusing the same memory
+// rather than fragmenting the heap with small objects.
+class Pool
+{
+public:
+    // With MARLY_THREADS the pools of a type on every thread share one
+    // Stats, since a block can be freed by a thread other than the one
+    // which allocated it
+#if MARLY_THREADS
+    using Counter = std::atomic<int32_t>;
+#else
+    using Counter = int32_t;
+#endif
+
+    struct Stats
+    {
+        Counter allocations { 0 };
+        Counter frees { 0 };
+        Counter live { 0 };
+        Counter peakLive { 0 };
+        Counter chunks { 0 };
+        
+        // The first pool using these stats reports them
+        bool listed = false;
+    };
+    
+    Pool(const char* name, size_t blockSize, uint16_t blocksPerChunk, Stats&);
+    
+    // Returns nullptr if a new chunk can't be allocated
+    void* alloc();
+    void free(void*);
+    
+    const char* name() const { return _name; }
+    size_t blockSize() const { return _blockSize; }
+    uint32_t capacity() const { return uint32_t(_stats.chunks) * _blocksPerChunk; }
+    const Stats& stats() const { return _stats; }
+    
+    // Percentage of the blocks owned by the pools of the type which are
+    // not in use
+    uint32_t fragmentation() const
+    {
+        uint32_t live = std::min(uint32_t(std::max(int32_t(_stats.live), 0)), capacity());
+        return capacity() ? ((capacity() - live) * 100 / capacity()) : 0;
+    }
+    
+    // Call f with one pool of each pooled type, for reporting
+    static void forEach(const std::function<void(const Pool&)>& f);
+
+private:
+    struct FreeBlock { FreeBlock* next; };
+    
+    void addChunk();
+    
+    const char* _name;
+    size_t _blockSize;
+    uint16_t _blocksPerChunk;
+    FreeBlock* _free = nullptr;
+    Stats& _stats;
+    
+    Pool* _next = nullptr;
+    static Pool* _first;
+};
+
+// Mix in to give a class a Pool of its own. Subclasses of different size
+// fall back to the heap. Each pooled class defines its pool() to give it
+// a name and chunk size.
+template<typename T>
+class Pooled
+{
+public:
+#if MARLY_POOL_ALLOC
+    // Fails the way the global allocator does, so callers never see
+    // nullptr. Without exceptions that means aborting
+    static void* operator new(size_t size)
+    {
+        if (size != sizeof(T)) {
+            return ::operator new(size);
+        }
+        void* p = pool().alloc();
+        if (!p) {
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS)
+            throw std::bad_alloc();
+#else
+            ::abort();
+#endif
+        }
+        return p;
+    }
+    
+    static void operator delete(void* p, size_t size)
+    {
+        if (size == sizeof(T)) {
+            pool().free(p);
+        } else {
+            ::operator delete(p);
+        }
+    }
+#endif
+
+    static Pool& pool();
+};
+
+// The Pool for T used by the calling thread. With MARLY_THREADS every
+// thread has its own, so free lists are never locked. Blocks freed by a
+// thread other than the one which allocated them go on the freeing
+// thread's free list. Per thread pools are never destroyed since their
+// blocks may outlive the thread.
+template<typename T>
+inline Pool& threadPool(const char* name, uint16_t blocksPerChunk)
+{
+    static Pool::Stats stats;
+#if MARLY_THREADS
+    static thread_local Pool* pool = new Pool(name, sizeof(T), blocksPerChunk, stats);
+    return *pool;
+#else
+    static Pool pool(name, sizeof(T), blocksPerChunk, stats);
+    return pool;
+#endif
+}
+
+}
@@ -0,0 +1,551 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "MarlyProgram.h"
+
+#include "GeneratedValues.h"
+#include "MarlyCode.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace marly;
+
+Program::Program()
+{
+    uint16_t count = 0;
+    const char** list = sharedAtoms(count);
+    _atomTable.setSharedAtomList(list, count);
+}
+
+Program::~Program()
+{
+    // Frozen objects refer to each other in any order. Empty the Lists
+    // before deleting anything, so nothing refers to a deleted object.
+    _root = Value();
+    for (ObjectBase* object : _objects) {
+        List* list = object->asList();
+        if (list) {
+            list->clear();
+            list->invalidateCode();
+        }
+    }
+    for (ObjectBase* object : _objects) {
+        delete object;
+    }
+}
+
+bool Program::findGlobal(m8r::Atom name, uint16_t& slot) const
+{
+    auto it = _globalSlots.find(name);
+    if (it == _globalSlots.end()) {
+        return false;
+    }
+    slot = it->value;
+    return true;
+}
+
+uint16_t Program::addGlobal(m8r::Atom name)
+{
+    uint16_t slot;
+    if (findGlobal(name, slot)) {
+        return slot;
+    }
+    
+    slot = uint16_t(_globalNames.size());
+    _globalNames.push_back(name);
+    _globalSlots.emplace(name, slot);
+    return slot;
+}
+
+void Program::finish(const Value& list)
+{
+    _root = list;
+    freeze(_root);
+    std::sort(_objects.begin(), _objects.end());
+    std::sort(_codes.begin(), _codes.end());
+}
+
+bool Program::canUse(const Value& value) const
+{
+    m8r::Vector<const ObjectBase*> seen;
+    return canUse(value, seen);
+}
+
+bool Program::canUse(const Value& value, m8r::Vector<const ObjectBase*>& seen) const
+{
+    List* list = value.list();
+    Map* map = value.map();
+    String* string = value.string();
+    ObjectBase* object = list ? static_cast<ObjectBase*>(list) : map ? static_cast<ObjectBase*>(map) : string;
+    if (!object) {
+        return true;
+    }
+    if (object->frozen()) {
+        return std::binary_search(_objects.begin(), _objects.end(), object);
+    }
+    
+    // Lists and Maps can refer to themselves
+    if (std::find(seen.begin(), seen.end(), object) != seen.end()) {
+        return true;
+    }
+    seen.push_back(object);
+    
+    if (string) {
+        string->string();
+        return true;
+    }
+    if (list) {
+        if (list->sharedCode() && !std::binary_search(_codes.begin(), _codes.end(), list->sharedCode())) {
+            return false;
+        }
+        for (const Value& element : *list) {
+            if (!canUse(element, seen)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    for (const auto& it : *map) {
+        if (!canUse(it.value, seen)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Program::freeze(const Value& value)
+{
+    List* list = value.list();
+    ObjectBase* object = list ? static_cast<ObjectBase*>(list) : static_cast<ObjectBase*>(value.string());
+    if (!object || object->frozen()) {
+        return;
+    }
+    
+    object->freeze();
+    _objects.push_back(object);
+    
+    if (list) {
+        // Compile now so the code is never created by two threads at once
+        _codes.push_back(list->code().get());
+        for (const Value& element : *list) {
+            freeze(element);
+        }
+    }
+}
+
+m8r::Atom Program::atomize(const char* s)
+{
+    // Most identifiers are built-in verbs, which are found without a search
+    int32_t shared = findSharedAtom(s);
+    if (shared >= 0) {
+        return m8r::Atom(m8r::Atom::value_type(shared));
+    }
+    
+    m8r::Atom atom = _atomTable.atomizeString(s);
+    if (atom.raw() >= m8r::ExternalAtomOffset) {
+        auto it = std::lower_bound(_atoms.begin(), _atoms.end(), atom);
+        if (it == _atoms.end() || *it != atom) {
+            _atoms.insert(it, atom);
+        }
+    }
+    return atom;
+}
+
+// Image layout. All numbers are little endian and all offsets are from
+// the start of the image.
+//
+//      Header      0   "\x7fMRL"
+//                  4   <u16> ImageVersion, <u16> Op::Count
+//                  8   <u32> hash of the shared atoms and Value types
+//                  12  <u32> size of the image
+//                  16  <u32> count, <u32> offset of each table below
+//                      in order, then <u32> index of the root List
+//      Atoms       <u16> atom, name NUL terminated, in order of atom
+//      Globals     <u16> atom of each slot
+//      Lists       <u32> offset of each List
+//      List        <u32> element count, <u32> constant count, <u32> code
+//                  size, the Values of the elements and constants, the code
+//      Strings     <u32> offset of each NUL terminated String
+//      Value       <u16> type, <u16> 0, <u32> payload. For a String or
+//                  List the payload is its index in the table
+static constexpr uint8_t ImageMagic[Program::ImageMagicSize] = { 0x7f, 'M', 'R', 'L' };
+static constexpr uint32_t ImageRootOffset = 48;
+static constexpr uint32_t ImageHeaderSize = 52;
+static constexpr uint32_t ImageValueSize = 8;
+
+enum class ImageTable { Atoms, Globals, Lists, Strings };
+
+static uint32_t tableOffset(ImageTable table) { return 16 + uint32_t(table) * 8; }
+
+static uint16_t get16(const uint8_t* p) { return uint16_t(p[0]) | (uint16_t(p[1]) << 8); }
+static uint32_t get32(const uint8_t* p) { return uint32_t(get16(p)) | (uint32_t(get16(p + 2)) << 16); }
+
+static uint32_t sharedAtomsHash()
+{
+    // FNV-1a of the atoms, NUL terminated, and the number of Value types
+    uint16_t count = 0;
+    const char** atoms = sharedAtoms(count);
+    uint32_t hash = 2166136261u;
+    for (uint16_t i = 0; i < count; ++i) {
+        const char* s = atoms[i];
+        do {
+            hash = (hash ^ uint8_t(*s)) * 16777619u;
+        } while (*s++);
+    }
+    return (hash ^ uint32_t(Value::Type::TokenVerb)) * 16777619u;
+}
+
+namespace {
+
+class ImageWriter
+{
+public:
+    ImageWriter(m8r::Vector<uint8_t>& image) : _image(image) { }
+    
+    uint32_t offset() const { return uint32_t(_image.size()); }
+    
+    void put8(uint8_t value) { _image.push_back(value); }
+    void put16(uint16_t value) { put8(uint8_t(value)); put8(uint8_t(value >> 8)); }
+    void put32(uint32_t value) { put16(uint16_t(value)); put16(uint16_t(value >> 16)); }
+    void putString(const char* s)
+    {
+        do {
+            put8(uint8_t(*s));
+        } while (*s++);
+    }
+    
+    void patch32(uint32_t offset, uint32_t value)
+    {
+        for (uint32_t i = 0; i < 4; ++i) {
+            _image[offset + i] = uint8_t(value >> (i * 8));
+        }
+    }
+    
+    void startTable(ImageTable table, uint32_t count)
+    {
+        patch32(tableOffset(table), count);
+        patch32(tableOffset(table) + 4, offset());
+    }
+
+private:
+    m8r::Vector<uint8_t>& _image;
+};
+
+}
+
+bool Program::isImageMagic(const uint8_t* magic)
+{
+    return memcmp(magic, ImageMagic, ImageMagicSize) == 0;
+}
+
+void Program::writeImage(m8r::Vector<uint8_t>& image) const
+{
+    assert(_root.type() == Value::Type::List);
+    
+    image.clear();
+    ImageWriter out(image);
+    for (uint32_t i = 0; i < ImageHeaderSize; ++i) {
+        out.put8(0);
+    }
+    for (uint32_t i = 0; i < ImageMagicSize; ++i) {
+        image[i] = ImageMagic[i];
+    }
+    image[4] = uint8_t(ImageVersion);
+    image[5] = uint8_t(ImageVersion >> 8);
+    image[6] = uint8_t(Op::Count);
+    out.patch32(8, sharedAtomsHash());
+    
+    out.startTable(ImageTable::Atoms, uint32_t(_atoms.size()));
+    for (m8r::Atom atom : _atoms) {
+        out.put16(atom.raw());
+        out.putString(_atomTable.stringFromAtom(atom));
+    }
+    
+    out.startTable(ImageTable::Globals, uint32_t(_globalNames.size()));
+    for (m8r::Atom atom : _globalNames) {
+        out.put16(atom.raw());
+    }
+    
+    // Number the Lists and Strings. Short strings are added to the
+    // Strings as they are written
+    m8r::Map<const ObjectBase*, uint32_t> indexes;
+    m8r::Vector<const List*> lists;
+    m8r::Vector<m8r::String> strings;
+    for (const ObjectBase* object : _objects) {
+        const List* list = object->asList();
+        if (list) {
+            indexes.emplace(object, uint32_t(lists.size()));
+            lists.push_back(list);
+        } else {
+            const String* string = static_cast<const String*>(object);
+            indexes.emplace(object, uint32_t(strings.size()));
+            strings.push_back(string->string());
+        }
+    }
+    
+    auto putValue = [&out, &indexes, &strings](const Value& value) {
+        uint32_t payload;
+        switch (value.type()) {
+            case Value::Type::String:
+                if (value.isShortString()) {
+                    String string;
+                    value.toString(string);
+                    payload = uint32_t(strings.size());
+                    strings.push_back(string.string());
+                } else {
+                    payload = indexes.find(value.string())->value;
+                }
+                break;
+            case Value::Type::List: payload = indexes.find(value.list())->value; break;
+            case Value::Type::Bool: payload = value.boolean() ? 1 : 0; break;
+            case Value::Type::Float: {
+                float f = value.flt();
+                memcpy(&payload, &f, sizeof(payload));
+                break;
+            }
+            case Value::Type::Map:
+            case Value::Type::NativeFunction:
+            case Value::Type::RawPointer:
+                // Never part of a loaded Program
+                assert(0);
+                payload = 0;
+                break;
+            default: payload = uint32_t(value.integer()); break;
+        }
+        out.put16(uint16_t(value.type()));
+        out.put16(0);
+        out.put32(payload);
+    };
+    
+    out.startTable(ImageTable::Lists, uint32_t(lists.size()));
+    uint32_t listOffsets = out.offset();
+    for (uint32_t i = 0; i < lists.size(); ++i) {
+        out.put32(0);
+    }
+    for (uint32_t i = 0; i < lists.size(); ++i) {
+        const List* list = lists[i];
+        const Code* code = list->code().get();
+        out.patch32(listOffsets + i * 4, out.offset());
+        out.put32(uint32_t(list->size()));
+        out.put32(code->constantCount());
+        out.put32(uint32_t(code->size()));
+        for (const Value& value : *list) {
+            putValue(value);
+        }
+        for (uint16_t c = 0; c < code->constantCount(); ++c) {
+            putValue(code->constant(c));
+        }
+        for (const uint8_t* pc = code->begin(); pc < code->end(); ++pc) {
+            out.put8(*pc);
+        }
+    }
+    
+    out.startTable(ImageTable::Strings, uint32_t(strings.size()));
+    uint32_t stringOffsets = out.offset();
+    for (uint32_t i = 0; i < strings.size(); ++i) {
+        out.put32(0);
+    }
+    for (uint32_t i = 0; i < strings.size(); ++i) {
+        out.patch32(stringOffsets + i * 4, out.offset());
+        out.putString(strings[i].c_str());
+    }
+    
+    out.patch32(ImageRootOffset, indexes.find(_root.list())->value);
+    out.patch32(12, out.offset());
+}
+
+Value Program::readValue(const uint8_t* p, const ValueVector& strings, const ValueVector& lists, const char*& error)
+{
+    uint16_t type = get16(p);
+    uint32_t payload = get32(p + 4);
+    
+    switch (static_cast<Value::Type>(type)) {
+        case Value::Type::String:
+            if (payload < strings.size()) {
+                return strings[payload];
+            }
+            break;
+        case Value::Type::List:
+            if (payload < lists.size()) {
+                return lists[payload];
+            }
+            break;
+        case Value::Type::Bool: return Value(payload != 0);
+        case Value::Type::Float: {
+            float f;
+            memcpy(&f, &payload, sizeof(f));
+            return Value(f);
+        }
+        case Value::Type::Map:
+        case Value::Type::NativeFunction:
+        case Value::Type::RawPointer:
+        case Value::Type::ShortString:
+            break;
+        default:
+        {
+            // Built-in verbs, Int and the operators
+            uint16_t sharedCount = 0;
+            sharedAtoms(sharedCount);
+            if ((type < m8r::ExternalAtomOffset && type >= sharedCount) || type > uint16_t(Value::Type::TokenVerb)) {
+                break;
+            }
+            
+            // A var in a List is compiled when the List is copied and
+            // changed, so its slot has to be checked here too
+            bool var = type == uint16_t(Value::Type::Load) || type == uint16_t(Value::Type::Store) || type == uint16_t(Value::Type::Exec);
+            if (var && payload >= globalCount()) {
+                break;
+            }
+            return Value(int32_t(payload), static_cast<Value::Type>(type));
+        }
+    }
+    
+    error = "invalid value in image";
+    return Value();
+}
+
+const char* Program::readImage(const uint8_t* image, uint32_t size)
+{
+    assert(!_root.list() && _atoms.empty() && _globalNames.empty());
+    
+    if (size < ImageHeaderSize || !isImageMagic(image)) {
+        return "not a Marly image";
+    }
+    if (get16(image + 4) != ImageVersion || get16(image + 6) != uint16_t(Op::Count) || get32(image + 8) != sharedAtomsHash()) {
+        return "image is for a different version of Marly";
+    }
+    if (get32(image + 12) != size) {
+        return "image is truncated";
+    }
+    
+    // Every access is checked against the size, in case the image is damaged
+    auto fits = [size](uint32_t offset, uint32_t length) { return offset <= size && length <= size - offset; };
+    auto cString = [image, size](uint32_t offset) -> const char* {
+        return (offset < size && memchr(image + offset, 0, size - offset)) ? reinterpret_cast<const char*>(image + offset) : nullptr;
+    };
+    auto table = [image, &fits](ImageTable table, uint32_t entrySize, uint32_t& count) -> uint32_t {
+        count = get32(image + tableOffset(table));
+        uint32_t offset = get32(image + tableOffset(table) + 4);
+        return (count < 0x10000000 && fits(offset, count * entrySize)) ? offset : 0;
+    };
+    
+    // Atoms are numbered in the order they are first seen, so adding them
+    // in order gives them the ids they had when the image was written
+    uint32_t count;
+    uint32_t offset = table(ImageTable::Atoms, 3, count);
+    for (uint32_t i = 0; i < count; ++i) {
+        const char* name = offset ? cString(offset + 2) : nullptr;
+        if (!name || atomize(name).raw() != get16(image + offset)) {
+            return "image atoms don't match";
+        }
+        offset += 2 + uint32_t(strlen(name)) + 1;
+    }
+    
+    offset = table(ImageTable::Globals, 2, count);
+    for (uint32_t i = 0; i < count; ++i) {
+        if (!offset || addGlobal(m8r::Atom(get16(image + offset + i * 2))) != i) {
+            return "invalid globals in image";
+        }
+    }
+    
+    ValueVector strings;
+    offset = table(ImageTable::Strings, 4, count);
+    for (uint32_t i = 0; i < count; ++i) {
+        const char* s = offset ? cString(get32(image + offset + i * 4)) : nullptr;
+        if (!s) {
+            return "invalid string in image";
+        }
+        strings.push_back(Value(s));
+    }
+    
+    // Create the Lists first, since they refer to each other by index
+    ValueVector lists;
+    offset = table(ImageTable::Lists, 4, count);
+    if (!offset) {
+        return "invalid list in image";
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        lists.push_back(Value(new List()));
+    }
+    
+    // Lists which aren't kept may refer to each other, so they are emptied
+    // to break the cycles
+    auto release = [&lists](const char* error) {
+        for (const Value& value : lists) {
+            List* list = value.list();
+            if (!list->frozen()) {
+                list->clear();
+                list->invalidateCode();
+            }
+        }
+        return error;
+    };
+    
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t listOffset = get32(image + offset + i * 4);
+        if (!fits(listOffset, 12)) {
+            return release("invalid list in image");
+        }
+        
+        const uint8_t* p = image + listOffset;
+        uint32_t elements = get32(p);
+        uint32_t constants = get32(p + 4);
+        uint32_t codeSize = get32(p + 8);
+        p += 12;
+        if (elements >= 0x1000000 || constants > 0xffff ||
+                !fits(listOffset + 12, (elements + constants) * ImageValueSize) ||
+                !fits(listOffset + 12 + (elements + constants) * ImageValueSize, codeSize)) {
+            return release("invalid list in image");
+        }
+        
+        const char* error = nullptr;
+        List* list = lists[i].list();
+        for (uint32_t e = 0; e < elements; ++e, p += ImageValueSize) {
+            list->push_back(readValue(p, strings, lists, error));
+        }
+        
+        // The code is run in place
+        Code* code = new Code(p + constants * ImageValueSize, int32_t(codeSize));
+        list->setCode(code);
+        for (uint32_t c = 0; c < constants; ++c, p += ImageValueSize) {
+            code->_constants.push_back(readValue(p, strings, lists, error));
+        }
+        if (error) {
+            return release(error);
+        }
+        if (!code->verify(globalCount())) {
+            return release("invalid code in image");
+        }
+    }
+    
+    uint32_t root = get32(image + ImageRootOffset);
+    if (root >= lists.size()) {
+        return release("invalid list in image");
+    }
+    
+    finish(lists[root]);
+    return release(nullptr);
+}
+
+const char* Program::readImage(const uint8_t* magic, const m8r::Stream& stream)
+{
+    _image.clear();
+    for (uint32_t i = 0; i < ImageMagicSize; ++i) {
+        _image.push_back(magic[i]);
+    }
+    while (!stream.eof()) {
+        int c = stream.read();
+        if (c < 0) {
+            break;
+        }
+        _image.push_back(uint8_t(c));
+    }
+    return readImage(&_image[0], uint32_t(_image.size()));
+}
@@ -0,0 +1,100 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "Atom.h"
+#include "Containers.h"
+#include "MarlyValue.h"
+#include "SharedPtr.h"
+#include "Stream.h"
+
+namespace marly {
+
+// The loaded and compiled form of a script: its Lists, their Code, its
+// atoms and the names of its global vars. Once loaded it never changes,
+// so any number of Marly instances can share one, each with its own stack
+// and vars. Loading freezes all its Lists and Strings. They are not
+// refcounted and are deleted with the Program.
+class Program : public m8r::Shared
+{
+public:
+    Program();
+    virtual ~Program();
+    
+    const Value& root() const { return _root; }
+    
+    const m8r::AtomTable& atomTable() const { return _atomTable; }
+    
+    // Identifiers are atomized through the Program so the ones it uses
+    // can be written to an image
+    m8r::Atom atomize(const char*);
+    
+    // Global vars are bound to slots at load time
+    uint16_t globalCount() const { return uint16_t(_globalNames.size()); }
+    m8r::Atom globalName(uint16_t slot) const { return _globalNames[slot]; }
+    bool findGlobal(m8r::Atom, uint16_t& slot) const;
+    
+    // Used while loading
+    uint16_t addGlobal(m8r::Atom);
+    
+    // Make list the root and freeze everything reachable from it
+    void finish(const Value& list);
+    
+    // False if value is or refers to a frozen object of another Program,
+    // which can be deleted while this one is running. Ropes are flattened
+    // so they no longer refer to the Strings they were made from
+    bool canUse(const Value&) const;
+    
+    // A Program can be saved as a binary image and loaded from it, without
+    // scanning or compiling. The image is position independent. Its code
+    // is run in place, so it can be in an mmapped file or in memory mapped
+    // flash. Anything which changes the shared atoms, the Value types or
+    // the opcodes changes ImageVersion, and images are rejected if they
+    // don't match. Host verbs are assumed to be registered in the same
+    // order as when the image was written. Code is verified as it is
+    // loaded, see Code::verify().
+    static constexpr uint16_t ImageVersion = 2;
+    static constexpr uint8_t ImageMagicSize = 4;
+    static bool isImageMagic(const uint8_t* magic);
+    
+    void writeImage(m8r::Vector<uint8_t>&) const;
+    
+    // Load the image into this empty Program. image must outlive the
+    // Program. Returns nullptr on success, otherwise a description of
+    // the error
+    const char* readImage(const uint8_t* image, uint32_t size);
+    
+    // Load an image from a stream whose first ImageMagicSize bytes, in
+    // magic, have already been read. The image is kept in RAM
+    const char* readImage(const uint8_t* magic, const m8r::Stream&);
+
+private:
+    void freeze(const Value&);
+    bool canUse(const Value&, m8r::Vector<const ObjectBase*>& seen) const;
+    Value readValue(const uint8_t*, const ValueVector& strings, const ValueVector& lists, const char*& error);
+    
+    Value _root;
+    m8r::AtomTable _atomTable;
+    
+    // Atoms which are not shared, sorted
+    m8r::Vector<m8r::Atom> _atoms;
+    m8r::Vector<m8r::Atom> _globalNames;
+    m8r::Map<m8r::Atom, uint16_t> _globalSlots;
+    
+    // Every frozen object, deleted with the Program, and the Code of each
+    // frozen List. Sorted when the Program is finished
+    m8r::Vector<ObjectBase*> _objects;
+    m8r::Vector<const Code*> _codes;
+    
+    // An image read from a stream
+    m8r::Vector<uint8_t> _image;
+};
+
+}
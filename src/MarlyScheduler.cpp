@@ -0,0 +1,225 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "MarlyScheduler.h"
+
+#include "SystemTime.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+using namespace marly;
+
+Scheduler::Scheduler(uint32_t sliceBudget)
+    : _sliceBudget(sliceBudget)
+    , _idle([](int64_t time) { std::this_thread::sleep_for(std::chrono::microseconds(time)); })
+{
+    for (TaskId& slot : _wheel) {
+        slot = NoTask;
+    }
+}
+
+int64_t Scheduler::now()
+{
+    return m8r::Time::now().us();
+}
+
+Scheduler::TaskId Scheduler::add(const m8r::SharedPtr<Marly>& marly)
+{
+    assert(_tasks.size() < NoTask);
+    TaskId id = TaskId(_tasks.size());
+    _tasks.push_back(Task());
+    _tasks[id].marly = marly;
+    marly->setSliceBudget(_sliceBudget);
+    marly->setSliceTime(_sliceTime);
+    marly->setEventNotify([this, id]() { wake(id); });
+    ++_activeTasks;
+    makeReady(id, now());
+    return id;
+}
+
+bool Scheduler::runOneIteration()
+{
+    if (_activeTasks == 0) {
+        return false;
+    }
+    
+    int64_t start = now();
+    advanceWheel(start);
+    
+    if (_readyHead == NoTask) {
+        // Everything is delayed or waiting. Wait for the first one to be
+        // due, or for a while to let events arrive
+        int64_t wake = nextWakeTime();
+        if (wake > start && _idle) {
+            _idle((wake == INT64_MAX) ? TickTime : (wake - start));
+        }
+        return true;
+    }
+    
+    TaskId id = _readyHead;
+    Task& task = _tasks[id];
+    _readyHead = task.next;
+    if (_readyHead == NoTask) {
+        _readyTail = NoTask;
+    }
+    task.next = NoTask;
+    
+    int64_t wait = start - task.readyTime;
+    task.stats.waitTime += wait;
+    if (wait > task.stats.maxWaitTime) {
+        task.stats.maxWaitTime = wait;
+    }
+    
+    m8r::CallReturnValue result = task.marly->execute();
+    int64_t end = now();
+    task.stats.runTime += end - start;
+    task.stats.slices++;
+    
+    if (result.isError()) {
+        task.state = TaskState::Error;
+        --_activeTasks;
+        task.marly->print(m8r::String::format("task %d: runtime error: %s\n", int32_t(id), task.marly->runtimeErrorString()).c_str());
+    } else if (result.isFinished() || result.type() == m8r::CallReturnValue::Type::Terminated) {
+        task.state = TaskState::Finished;
+        --_activeTasks;
+    } else if (result.isDelay()) {
+        task.stats.delays++;
+        delay(id, end + task.marly->delayTime());
+    } else if (result.isWaitForEvent()) {
+        // Parked until wake()
+        task.stats.waits++;
+        task.state = TaskState::Waiting;
+    } else {
+        // Yield or anything else just goes to the back of the line
+        task.stats.yields++;
+        makeReady(id, end);
+    }
+    return _activeTasks != 0;
+}
+
+void Scheduler::makeReady(TaskId id, int64_t time)
+{
+    Task& task = _tasks[id];
+    task.state = TaskState::Ready;
+    task.readyTime = time;
+    task.next = NoTask;
+    if (_readyTail == NoTask) {
+        _readyHead = id;
+    } else {
+        _tasks[_readyTail].next = id;
+    }
+    _readyTail = id;
+}
+
+void Scheduler::delay(TaskId id, int64_t time)
+{
+    Task& task = _tasks[id];
+    int64_t tick = time / TickTime;
+    if (tick <= _currentTick) {
+        // Its slot has already been passed
+        makeReady(id, time);
+        return;
+    }
+    
+    task.state = TaskState::Delayed;
+    task.wakeTime = time;
+    TaskId& slot = _wheel[tick % WheelSize];
+    task.next = slot;
+    slot = id;
+}
+
+void Scheduler::wake(TaskId id)
+{
+    Task& task = _tasks[id];
+    if (task.state == TaskState::Waiting) {
+        makeReady(id, now());
+        return;
+    }
+    if (task.state != TaskState::Delayed) {
+        return;
+    }
+    
+    TaskId* link = &_wheel[(task.wakeTime / TickTime) % WheelSize];
+    while (*link != id) {
+        assert(*link != NoTask);
+        link = &_tasks[*link].next;
+    }
+    *link = task.next;
+    makeReady(id, now());
+}
+
+void Scheduler::advanceWheel(int64_t time)
+{
+    // Only ticks which have completely passed are looked at, so a task
+    // never wakes before its time
+    int64_t lastTick = time / TickTime - 1;
+    if (_currentTick < 0) {
+        _currentTick = lastTick;
+        return;
+    }
+    
+    // Look at each slot passed since last time, but never more than one
+    // full turn of the wheel
+    int64_t first = std::max(_currentTick + 1, lastTick - int64_t(WheelSize) + 1);
+    for (int64_t t = first; t <= lastTick; ++t) {
+        TaskId* link = &_wheel[t % WheelSize];
+        while (*link != NoTask) {
+            TaskId id = *link;
+            Task& task = _tasks[id];
+            if (task.wakeTime > time) {
+                // Due in a later turn of the wheel
+                link = &task.next;
+                continue;
+            }
+            *link = task.next;
+            makeReady(id, task.wakeTime);
+        }
+    }
+    _currentTick = std::max(_currentTick, lastTick);
+}
+
+int64_t Scheduler::nextWakeTime() const
+{
+    // advanceWheel takes a task off once the tick of its wake time has
+    // passed
+    int64_t wake = INT64_MAX;
+    for (TaskId slot : _wheel) {
+        for (TaskId id = slot; id != NoTask; id = _tasks[id].next) {
+            wake = std::min(wake, (_tasks[id].wakeTime / TickTime + 1) * TickTime);
+        }
+    }
+    return wake;
+}
+
+void Scheduler::printStats() const
+{
+    if (_tasks.empty()) {
+        return;
+    }
+    
+    const Marly* marly = _tasks[0].marly.get();
+    marly->print("Task  state     slices   yields   delays    waits    run(ms)   wait(ms)  maxwait(ms)\n");
+    for (TaskId id = 0; id < _tasks.size(); ++id) {
+        const Task& task = _tasks[id];
+        const char* state = "";
+        switch (task.state) {
+            case TaskState::Ready: state = "ready"; break;
+            case TaskState::Delayed: state = "delayed"; break;
+            case TaskState::Waiting: state = "waiting"; break;
+            case TaskState::Finished: state = "finished"; break;
+            case TaskState::Error: state = "error"; break;
+        }
+        marly->print(m8r::String::format("%4d  %-8s %7d  %7d  %7d  %7d  %9d  %9d  %11d\n", int32_t(id), state,
+                                         task.stats.slices, task.stats.yields, task.stats.delays, task.stats.waits,
+                                         int32_t(task.stats.runTime / 1000), int32_t(task.stats.waitTime / 1000),
+                                         int32_t(task.stats.maxWaitTime / 1000)).c_str());
+    }
+}
@@ -0,0 +1,124 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "Containers.h"
+#include "Marly.h"
+#include "SharedPtr.h"
+
+#include <functional>
+
+namespace marly {
+
+// Runs any number of loaded Marly programs cooperatively. Each task runs
+// for at most its slice budget before it yields to the next ready task.
+// Delayed tasks wait on a timer wheel so waking them doesn't depend on
+// how many tasks are waiting. A delayed task is woken early when an event
+// is fired for it. A task waiting for an event or for more of an
+// incremental load isn't run again until one arrives.
+class Scheduler
+{
+public:
+    using TaskId = uint16_t;
+
+    struct Stats
+    {
+        uint32_t slices = 0;
+        uint32_t yields = 0;
+        uint32_t delays = 0;
+        uint32_t waits = 0;
+
+        // In microseconds. Wait is the time spent ready but not running
+        int64_t runTime = 0;
+        int64_t waitTime = 0;
+        int64_t maxWaitTime = 0;
+    };
+
+    enum class TaskState { Ready, Delayed, Waiting, Finished, Error };
+
+    static constexpr uint32_t DefaultSliceBudget = 1000;
+
+    Scheduler(uint32_t sliceBudget = DefaultSliceBudget);
+    
+    // Also limit each slice to time microseconds. Applies to tasks added
+    // after it is set
+    void setSliceTime(int64_t time) { _sliceTime = time; }
+
+    // Called with the number of microseconds until the next delayed task
+    // is due when no task is ready, or 10ms if no task is delayed. It
+    // may return early, for instance when a timer fires an event. The
+    // default sleeps the thread. Targets with their own event loop should
+    // run it here so timers can fire and input can arrive
+    using Idle = std::function<void(int64_t time)>;
+    void setIdle(const Idle& idle) { _idle = idle; }
+
+    TaskId add(const m8r::SharedPtr<Marly>&);
+
+    // Run one slice of the next ready task. Returns false once all tasks
+    // have finished
+    bool runOneIteration();
+
+    // Run until all tasks finish
+    void run() { while (runOneIteration()) { } }
+
+    uint32_t taskCount() const { return uint32_t(_tasks.size()); }
+    TaskState state(TaskId id) const { return _tasks[id].state; }
+    const Stats& stats(TaskId id) const { return _tasks[id].stats; }
+    const Marly* marly(TaskId id) const { return _tasks[id].marly.get(); }
+
+    void printStats() const;
+
+private:
+    static constexpr TaskId NoTask = 0xffff;
+
+    // 64 slots of 10ms. Tasks delayed longer than a turn of the wheel
+    // stay in their slot until their wake time comes around
+    static constexpr uint32_t WheelSize = 64;
+    static constexpr int64_t TickTime = 10000;
+
+    struct Task
+    {
+        m8r::SharedPtr<Marly> marly;
+        Stats stats;
+        TaskState state = TaskState::Ready;
+        int64_t readyTime = 0;
+        int64_t wakeTime = 0;
+
+        // Next task in the ready queue or wheel slot
+        TaskId next = NoTask;
+    };
+
+    static int64_t now();
+
+    void makeReady(TaskId, int64_t time);
+    void delay(TaskId, int64_t time);
+    
+    // An event or loaded form arrived for the task. If it is delayed or
+    // waiting make it ready now
+    void wake(TaskId);
+    void advanceWheel(int64_t time);
+    
+    // When the earliest delayed task will be taken off the wheel
+    int64_t nextWakeTime() const;
+
+    m8r::Vector<Task> _tasks;
+    uint32_t _sliceBudget;
+    int64_t _sliceTime = 0;
+    Idle _idle;
+    uint32_t _activeTasks = 0;
+
+    TaskId _readyHead = NoTask;
+    TaskId _readyTail = NoTask;
+
+    TaskId _wheel[WheelSize];
+    int64_t _currentTick = -1;
+};
+
+}
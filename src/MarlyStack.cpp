@@ -0,0 +1,82 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "MarlyStack.h"
+
+#include <cstdlib>
+
+#if MARLY_STACK_GUARD
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace marly;
+
+OperandStack::~OperandStack()
+{
+    pop(size());
+    release();
+}
+
+bool OperandStack::setCapacity(uint32_t capacity)
+{
+    if (!empty()) {
+        return false;
+    }
+    if (capacity != this->capacity()) {
+        release();
+        allocate(capacity);
+    }
+    return true;
+}
+
+void OperandStack::release()
+{
+#if MARLY_STACK_GUARD
+    if (_mapped) {
+        munmap(_memory, _memorySize);
+        _memory = nullptr;
+        _mapped = false;
+        return;
+    }
+#endif
+    ::free(_memory);
+    _memory = nullptr;
+}
+
+void OperandStack::allocate(uint32_t capacity)
+{
+#if MARLY_STACK_GUARD
+    // A page on each side can't be accessed. The capacity is rounded up
+    // to whole pages, so the Values start right at the lower one and end
+    // right at the upper one. If the memory can't be mapped or protected
+    // fall back to the heap, without guard pages
+    size_t page = size_t(sysconf(_SC_PAGESIZE));
+    size_t bytes = (capacity * sizeof(Value) + page - 1) & ~(page - 1);
+    size_t size = bytes + 2 * page;
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory != MAP_FAILED) {
+        uint8_t* bottom = static_cast<uint8_t*>(memory);
+        if (mprotect(bottom, page, PROT_NONE) == 0 && mprotect(bottom + page + bytes, page, PROT_NONE) == 0) {
+            _memory = memory;
+            _memorySize = size;
+            _mapped = true;
+            _begin = _top = reinterpret_cast<Value*>(bottom + page);
+            _end = _begin + bytes / sizeof(Value);
+            return;
+        }
+        munmap(memory, size);
+    }
+#endif
+    // If there's no memory the capacity is 0, so there is never room to run
+    _memory = ::malloc(capacity * sizeof(Value));
+    _begin = static_cast<Value*>(_memory);
+    _end = _memory ? (_begin + capacity) : _begin;
+    _top = _begin;
+}
@@ -0,0 +1,72 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "MarlyValue.h"
+
+#include <new>
+
+// Set MARLY_STACK_GUARD to 1 to put the operand stack between pages which
+// can't be accessed, so running off either end of it traps. The capacity
+// is rounded up to fill whole pages so both ends touch a guard page. Room
+// is still checked, so a trap means a bug in the interpreter or verifier
+// rather than in the program. It needs mmap and mprotect. Off by default.
+#ifndef MARLY_STACK_GUARD
+#define MARLY_STACK_GUARD 0
+#endif
+
+namespace marly {
+
+// Operand stack of a Marly. It has a fixed capacity and is allocated once,
+// so it never reallocates and Values on it never move. Pushing and popping
+// aren't checked. Underflow is prevented by the Checks the verifier puts
+// in Code. Overflow is prevented by making sure there is room for what a
+// Code can push before running it.
+class OperandStack
+{
+public:
+    static constexpr uint32_t DefaultCapacity = 256;
+
+    OperandStack(uint32_t capacity = DefaultCapacity) { allocate(capacity); }
+    ~OperandStack();
+
+    OperandStack(const OperandStack&) = delete;
+    OperandStack& operator=(const OperandStack&) = delete;
+
+    // False, with nothing changed, if the stack isn't empty
+    bool setCapacity(uint32_t);
+
+    uint32_t capacity() const { return uint32_t(_end - _begin); }
+    uint32_t size() const { return uint32_t(_top - _begin); }
+    bool empty() const { return _top == _begin; }
+    uint32_t room() const { return uint32_t(_end - _top); }
+
+    void push(const Value& value) { new (_top) Value(value); ++_top; }
+    void push(Value&& value) { new (_top) Value(std::move(value)); ++_top; }
+    void pop() { (--_top)->~Value(); }
+    void pop(uint32_t n) { while (n--) { pop(); } }
+
+    // 0 is TOS, -1 is the value under it
+    Value& top(int32_t rel = 0) { return _top[rel - 1]; }
+    const Value& top(int32_t rel = 0) const { return _top[rel - 1]; }
+
+private:
+    void allocate(uint32_t capacity);
+    void release();
+
+    Value* _begin = nullptr;
+    Value* _top = nullptr;
+    Value* _end = nullptr;
+    void* _memory = nullptr;
+    size_t _memorySize = 0;
+    bool _mapped = false;
+};
+
+}
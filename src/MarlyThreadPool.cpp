@@ -0,0 +1,250 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "MarlyThreadPool.h"
+
+#if MARLY_THREADS
+
+#include "SystemTime.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+using namespace marly;
+
+ThreadPool::ThreadPool(uint32_t threads, uint32_t sliceBudget)
+    : _sliceBudget(sliceBudget)
+    , _activeTasks(0)
+{
+    if (threads == 0) {
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    for (uint32_t i = 0; i < threads; ++i) {
+        _workers.emplace_back(new Worker());
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    for (auto& worker : _workers) {
+        if (worker->thread.joinable()) {
+            worker->thread.join();
+        }
+    }
+    for (Task* task : _tasks) {
+        delete task;
+    }
+}
+
+ThreadPool::TaskId ThreadPool::add(const m8r::SharedPtr<Marly>& marly)
+{
+    Task* task = new Task();
+    task->marly = marly;
+    marly->setSliceBudget(_sliceBudget);
+    ++_activeTasks;
+    _tasks.push_back(task);
+
+    // Deal tasks out round robin. Stealing evens out the rest
+    push(_nextWorker, task);
+    _nextWorker = (_nextWorker + 1) % _workers.size();
+    return TaskId(_tasks.size() - 1);
+}
+
+void ThreadPool::fireEvent(TaskId id, Value event)
+{
+    Task* task = _tasks[id];
+    {
+        std::lock_guard<std::mutex> lock(task->eventMutex);
+        task->events.push_back(std::move(event));
+    }
+    
+    // If it's waiting on a delay it runs now to handle the event
+    bool woke = false;
+    {
+        std::lock_guard<std::mutex> lock(_delayMutex);
+        if (task->delayed) {
+            _delayed.erase(task->delayEntry);
+            task->delayed = false;
+            woke = true;
+        }
+    }
+    if (woke) {
+        push(id % _workers.size(), task);
+    }
+}
+
+void ThreadPool::run()
+{
+    for (uint32_t i = 0; i < _workers.size(); ++i) {
+        _workers[i]->thread = std::thread(&ThreadPool::workerLoop, this, i);
+    }
+    for (auto& worker : _workers) {
+        worker->thread.join();
+    }
+}
+
+void ThreadPool::push(uint32_t index, Task* task)
+{
+    {
+        Worker& worker = *_workers[index];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.queue.push_back(task);
+    }
+    notify();
+}
+
+void ThreadPool::notify(bool all)
+{
+    {
+        std::lock_guard<std::mutex> lock(_idleMutex);
+        ++_workSerial;
+    }
+    if (all) {
+        _workAvailable.notify_all();
+    } else {
+        _workAvailable.notify_one();
+    }
+}
+
+ThreadPool::Task* ThreadPool::nextTask(uint32_t index)
+{
+    // Take from the front of our own queue, steal from the back of the others
+    {
+        Worker& worker = *_workers[index];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (!worker.queue.empty()) {
+            Task* task = worker.queue.front();
+            worker.queue.pop_front();
+            return task;
+        }
+    }
+
+    for (uint32_t i = 1; i < _workers.size(); ++i) {
+        Worker& victim = *_workers[(index + i) % _workers.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.queue.empty()) {
+            Task* task = victim.queue.back();
+            victim.queue.pop_back();
+            _workers[index]->stats.steals++;
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+bool ThreadPool::wakeDelayed(uint32_t index)
+{
+    int64_t now = m8r::Time::now().us();
+    bool woke = false;
+
+    std::lock_guard<std::mutex> lock(_delayMutex);
+    while (!_delayed.empty() && _delayed.begin()->first <= now) {
+        Task* task = _delayed.begin()->second;
+        task->delayed = false;
+        push(index, task);
+        _delayed.erase(_delayed.begin());
+        woke = true;
+    }
+    return woke;
+}
+
+int64_t ThreadPool::nextWakeTime()
+{
+    std::lock_guard<std::mutex> lock(_delayMutex);
+    return _delayed.empty() ? INT64_MAX : _delayed.begin()->first;
+}
+
+void ThreadPool::workerLoop(uint32_t index)
+{
+    Worker& worker = *_workers[index];
+
+    while (_activeTasks) {
+        Task* task = nextTask(index);
+        uint64_t serial = 0;
+        if (!task) {
+            // Anything queued after reading the serial changes it, so the
+            // wait below can't miss it. Look again for anything queued
+            // before
+            {
+                std::lock_guard<std::mutex> lock(_idleMutex);
+                serial = _workSerial;
+            }
+            task = nextTask(index);
+        }
+        if (!task) {
+            if (wakeDelayed(index)) {
+                continue;
+            }
+            
+            int64_t wake = nextWakeTime();
+            std::unique_lock<std::mutex> lock(_idleMutex);
+            auto ready = [this, serial]() { return _workSerial != serial || !_activeTasks; };
+            if (wake == INT64_MAX) {
+                _workAvailable.wait(lock, ready);
+            } else {
+                _workAvailable.wait_for(lock, std::chrono::microseconds(wake - m8r::Time::now().us()), ready);
+            }
+            continue;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(task->eventMutex);
+            for (const Value& event : task->events) {
+                task->marly->fireEvent(event);
+            }
+            task->events.clear();
+        }
+
+        m8r::CallReturnValue result = task->marly->execute();
+        worker.stats.slices++;
+
+        if (result.isError() || result.isFinished() || result.type() == m8r::CallReturnValue::Type::Terminated) {
+            if (result.isError()) {
+                task->marly->print(m8r::String::format("runtime error: %s\n", task->marly->runtimeErrorString()).c_str());
+            }
+            if (--_activeTasks == 0) {
+                notify(true);
+            }
+        } else if (result.isDelay()) {
+            // An event fired while it ran wakes it right away. This is
+            // checked under _delayMutex, so an event fired after it sees
+            // the task delayed and wakes it
+            std::unique_lock<std::mutex> lock(_delayMutex);
+            bool pending;
+            {
+                std::lock_guard<std::mutex> eventLock(task->eventMutex);
+                pending = !task->events.empty();
+            }
+            if (pending) {
+                lock.unlock();
+                push(index, task);
+            } else {
+                task->delayEntry = _delayed.emplace(m8r::Time::now().us() + task->marly->delayTime(), task);
+                task->delayed = true;
+            }
+        } else {
+            push(index, task);
+        }
+
+        // Don't let delayed tasks wait behind a long queue
+        if ((worker.stats.slices & 0x3f) == 0) {
+            wakeDelayed(index);
+        }
+    }
+}
+
+void ThreadPool::printStats() const
+{
+    for (uint32_t i = 0; i < _workers.size(); ++i) {
+        ::printf("Thread %2d: %8d slices %6d steals\n", i, _workers[i]->stats.slices, _workers[i]->stats.steals);
+    }
+}
+
+#endif
@@ -0,0 +1,130 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2019, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "MarlyPool.h"
+
+#if MARLY_THREADS
+
+#include "Marly.h"
+#include "MarlyScheduler.h"
+#include "SharedPtr.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace marly {
+
+// Runs independent Marly programs on a pool of worker threads, for hosts
+// built with MARLY_THREADS. Each worker has its own queue of ready tasks
+// and steals from the others when it runs dry. A task runs on only one
+// thread at a time, one slice at a time like the Scheduler.
+//
+// Programs must not share Values with each other, except through a
+// shared Program, whose objects are frozen. Each one has its own stack and
+// globals, and objects are not locked. Events are fired with fireEvent(),
+// which queues them for the thread that next runs the program. Workers
+// with nothing to run sleep until a task is queued or a delay ends.
+class ThreadPool
+{
+public:
+    struct Stats
+    {
+        uint32_t slices = 0;
+        uint32_t steals = 0;
+    };
+
+    // 0 threads means one per hardware thread
+    ThreadPool(uint32_t threads = 0, uint32_t sliceBudget = Scheduler::DefaultSliceBudget);
+    ~ThreadPool();
+
+    using TaskId = uint32_t;
+
+    // Add before calling run()
+    TaskId add(const m8r::SharedPtr<Marly>&);
+
+    // Can be called from any thread. Values are not locked, so the event
+    // is taken over by the pool. The caller must not hold another
+    // reference to its List unless it belongs to the shared Program. A
+    // delayed task is woken to run it
+    void fireEvent(TaskId, Value event);
+
+    // Run all the tasks to completion
+    void run();
+
+    uint32_t threadCount() const { return uint32_t(_workers.size()); }
+    const Stats& stats(uint32_t thread) const { return _workers[thread]->stats; }
+
+    void printStats() const;
+
+private:
+    struct Task
+    {
+        m8r::SharedPtr<Marly> marly;
+        
+        // Events fired from other threads, passed to marly just before
+        // it runs
+        std::mutex eventMutex;
+        std::vector<Value> events;
+        
+        // Where it is in _delayed while it is delayed, guarded by
+        // _delayMutex
+        bool delayed = false;
+        std::multimap<int64_t, Task*>::iterator delayEntry;
+    };
+
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<Task*> queue;
+        std::thread thread;
+        Stats stats;
+    };
+
+    void workerLoop(uint32_t index);
+    Task* nextTask(uint32_t index);
+    void push(uint32_t index, Task*);
+    bool wakeDelayed(uint32_t index);
+    
+    // Time the first delayed task is due, INT64_MAX if there are none
+    int64_t nextWakeTime();
+    
+    // Wake a worker waiting for work, or all of them
+    void notify(bool all = false);
+
+    std::vector<std::unique_ptr<Worker>> _workers;
+    
+    // Deleted after the threads are joined, since a shared Program's
+    // refcount is not atomic
+    std::vector<Task*> _tasks;
+    uint32_t _sliceBudget;
+    uint32_t _nextWorker = 0;
+    std::atomic<uint32_t> _activeTasks;
+
+    // Delayed tasks by wake time
+    std::mutex _delayMutex;
+    std::multimap<int64_t, Task*> _delayed;
+    
+    // Idle workers wait on _workAvailable. _workSerial changes whenever
+    // work is queued, so a worker can tell if it missed any
+    std::mutex _idleMutex;
+    std::condition_variable _workAvailable;
+    uint64_t _workSerial = 0;
+};
+
+}
+
+#endif
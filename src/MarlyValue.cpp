@@ -9,10 +9,114 @@
 
 #include "MarlyValue.h"
 
+#include <algorithm>
+
 using namespace marly;
 
 Map::Map(const Value& proto)
 {
     setProperty(SAtom(SA::__proto), proto);
-    proto.property(SAtom(SA::__ctor))(nullptr, this);
+}
+
+String::String(String* left, String* right)
+    : _left(left)
+    , _right(right)
+    , _length(left->length() + right->length())
+    , _depth(std::max(left->_depth, right->_depth) + 1)
+{
+    _left->retain();
+    _right->retain();
+}
+
+String::~String()
+{
+    if (_left) {
+        _left->release();
+        _right->release();
+    }
+}
+
+void String::flatten() const
+{
+    if (!_left) {
+        return;
+    }
+    
+    m8r::String str;
+    appendTo(str);
+    _str = str;
+    _left->release();
+    _right->release();
+    _left = nullptr;
+    _right = nullptr;
+}
+
+void String::appendTo(m8r::String& str) const
+{
+    if (_left) {
+        _left->appendTo(str);
+        _right->appendTo(str);
+    } else {
+        str += _str;
+    }
+}
+
+Value String::cat(Value left, const Value& right)
+{
+    String* leftString = left.string();
+    String* rightString = right.string();
+    
+    // Appending in place whatever the length of right keeps repeated cat
+    // onto the same String linear
+    if (leftString && leftString->refcount() == 1 && !leftString->_left) {
+        if (rightString) {
+            rightString->appendTo(leftString->_str);
+        } else {
+            String s;
+            right.toString(s);
+            leftString->_str += s.string();
+        }
+        return left;
+    }
+    
+    // Anything that isn't a String object is small, make a String for it
+    Value leftValue = left;
+    if (!leftString) {
+        leftString = new String();
+        left.toString(*leftString);
+        leftValue = Value(leftString);
+    }
+    Value rightValue = right;
+    if (!rightString) {
+        rightString = new String();
+        right.toString(*rightString);
+        rightValue = Value(rightString);
+    }
+    
+    if (leftString->length() + rightString->length() < MinRopeLength) {
+        m8r::String str = leftString->string();
+        str += rightString->string();
+        return Value(str.c_str());
+    }
+    
+    Value result(new String(leftString, rightString));
+    if (result.string()->_depth > MaxRopeDepth) {
+        result.string()->flatten();
+    }
+    return result;
+}
+
+template<> Pool& Pooled<List>::pool()
+{
+    return threadPool<List>("List", 16);
+}
+
+template<> Pool& Pooled<Map>::pool()
+{
+    return threadPool<Map>("Map", 8);
+}
+
+template<> Pool& Pooled<String>::pool()
+{
+    return threadPool<String>("String", 16);
 }
@@ -11,10 +11,32 @@
 
 #include "Atom.h"
 #include "GeneratedValues.h"
+#include "MarlyPool.h"
 #include "SharedPtr.h"
 
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+
+// On 64 bit hosts a Value is normally 16 bytes: a 16 bit Type, padding and
+// an 8 byte union. MARLY_COMPACT_VALUE packs the Type and payload into a
+// single 64 bit word, which needs every pointer to fit in 48 bits. It is
+// the default on x86_64 only. arm64 pointers can carry tag bits in the top
+// byte (TBI, MTE), so it uses the regular layout. On 32 bit targets the
+// regular layout is already 8 bytes.
+#ifndef MARLY_COMPACT_VALUE
+#if defined(__x86_64__) || defined(_M_X64)
+#define MARLY_COMPACT_VALUE 1
+#else
+#define MARLY_COMPACT_VALUE 0
+#endif
+#endif
+
 namespace marly {
 
+class Code;
+class List;
 class Marly;
 class Value;
 
@@ -24,16 +46,52 @@ using ValueVector = m8r::Vector<Value>;
 // Pass args as a List and return a value which can be any type
 using NativeFunction = Value(*)(Marly*, const Value&);
 
-class ObjectBase : public m8r::Shared
+// Base of the heap objects a Value can refer to. Objects are intrusively
+// reference counted by the Values holding them and deleted when the
+// last one goes away.
+class ObjectBase
 {
 public:
+    ObjectBase() { }
+    ObjectBase(const ObjectBase&) { }
+    ObjectBase& operator=(const ObjectBase&) { return *this; }
     virtual ~ObjectBase() { }
+    
     virtual Value property(m8r::Atom) const;
     virtual void setProperty(m8r::Atom, const Value&) { }
     virtual Value callProperty(m8r::Atom);
+    
+    // The object as a List, nullptr if it isn't one. Avoids needing RTTI
+    virtual List* asList() { return nullptr; }
+    const List* asList() const { return const_cast<ObjectBase*>(this)->asList(); }
+    
+    void retain()
+    {
+        if (_refcount != Frozen) {
+            ++_refcount;
+        }
+    }
+    void release()
+    {
+        assert(_refcount > 0);
+        if (_refcount != Frozen && --_refcount == 0) {
+            delete this;
+        }
+    }
+    uint32_t refcount() const { return _refcount; }
+    
+    // A frozen object is part of a Program. It is no longer refcounted,
+    // so it can be shared between threads, and lives as long as the Program
+    void freeze() { _refcount = Frozen; }
+    bool frozen() const { return _refcount == Frozen; }
+
+private:
+    static constexpr uint32_t Frozen = 0xffffffff;
+    
+    uint32_t _refcount = 0;
 };
 
-class Map : public ObjectBase, public ValueMap
+class Map : public ObjectBase, public ValueMap, public Pooled<Map>
 {
 public:
     Map() { }
@@ -45,27 +103,72 @@ public:
     virtual Value callProperty(m8r::Atom) override;
 };
 
-class List : public ObjectBase, public ValueVector
+class List : public ObjectBase, public ValueVector, public Pooled<List>
 {
 public:
-    virtual ~List() { }
+    virtual ~List();
     virtual Value property(m8r::Atom) const override;
     virtual void setProperty(m8r::Atom prop, const Value& value) override;
+    virtual List* asList() override { return this; }
+    
+    // Compiled form of the List, created on first use. Anything
+    // changing the contents of the List must call invalidateCode()
+    const m8r::SharedPtr<Code>& code() const;
+    void invalidateCode();
+    
+    // Use code compiled elsewhere, from a Program image
+    void setCode(Code*);
+    
+    // Unfrozen shallow copy. Until it is changed it runs the code of
+    // this List if this one is frozen
+    List* clone() const;
+    
+    // Code of the frozen List this is a clone of, nullptr if none
+    const Code* sharedCode() const { return _sharedCode; }
+
+private:
+    mutable m8r::SharedPtr<Code> _code;
+    const Code* _sharedCode = nullptr;
 };
 
-class String : public ObjectBase
+// A String is either flat or a rope, the concatenation of two other
+// Strings. Ropes make cat O(1). The chars are only gathered into a flat
+// string the first time string() is called.
+class String : public ObjectBase, public Pooled<String>
 {
 public:
-    virtual ~String() { }
+    String() { }
+    String(String* left, String* right);
+    virtual ~String();
+    
+    m8r::String& string() { flatten(); return _str; }
+    const m8r::String& string() const { flatten(); return _str; }
     
-    m8r::String& string() { return _str; }
-    const m8r::String& string() const { return _str; }
+    size_t length() const { return _left ? _length : _str.size(); }
 
     virtual Value property(m8r::Atom) const override;
     virtual void setProperty(m8r::Atom, const Value&) override { }
+    
+    // Concatenate the string forms of left and right. If left is a flat
+    // String nobody else refers to, right is appended to it in place
+    static Value cat(Value left, const Value& right);
 
 private:
-    m8r::String _str;
+    // Results shorter than this are built flat rather than as a rope
+    static constexpr size_t MinRopeLength = 32;
+    
+    // Deeper ropes are flattened. This bounds the recursion when
+    // flattening and destroying a rope
+    static constexpr uint8_t MaxRopeDepth = 32;
+    
+    void flatten() const;
+    void appendTo(m8r::String&) const;
+    
+    mutable m8r::String _str;
+    mutable String* _left = nullptr;
+    mutable String* _right = nullptr;
+    size_t _length = 0;
+    uint8_t _depth = 0;
 };
 
 class Value
@@ -80,129 +183,170 @@ public:
         String, List, Map,
         NativeFunction, RawPointer,
         
+        // Stored inline. type() reports it as String
+        ShortString,
+        
         // Built-in operators
         Load, Store, Exec, LoadProp, StoreProp, ExecProp,
         TokenVerb,
     };
     
-    Value() { _type = Type::Undefined; _int = 0; }
-    Value(bool b) { _type = Type::Bool; _bool = b; }
-    Value(Type t) { _type = t; }
+    Value() { set(Type::Undefined, 0); }
+    Value(bool b) { set(Type::Bool, b ? 1 : 0); }
+    Value(Type t) { set(t, 0); }
+    // Strings up to MaxShortStringLength chars are stored in the Value
+    // itself, avoiding an allocation
     Value(const char* s)
     {
-        _type = Type::String;
-        _ptr = nullptr;
-        m8r::SharedPtr<String>* str = reinterpret_cast<m8r::SharedPtr<String>*>(&_ptr);
-        str->reset(new String());
-        (*str)->string() = s;
+        size_t length = strlen(s);
+        if (length <= MaxShortStringLength) {
+            setShortString(s, length);
+        } else {
+            String* str = new String();
+            str->string() = s;
+            setValue(Type::String, str);
+        }
     }
     
-    Value(float f) { _type = Type::Float; _float = f; }
-    Value(const m8r::SharedPtr<List>& list) { setValue(Type::List, list.get()); }
+    Value(float f) { set(Type::Float, f); }
     Value(List* list) { setValue(Type::List, list); }
-    Value(const m8r::SharedPtr<String>& string) { setValue(Type::String, string.get()); }
     Value(String* string) { setValue(Type::String, string); }
-    Value(const m8r::SharedPtr<Map>& map) { setValue(Type::Map, map.get()); }
     Value(Map* map) { setValue(Type::Map, map); }
-    Value(NativeFunction func) { _type = Type::NativeFunction; _ptr = reinterpret_cast<void*>(func); }
-    Value(void* p) { _type = Type::RawPointer; _ptr = p; }
+    Value(NativeFunction func) { setPtr(Type::NativeFunction, reinterpret_cast<void*>(func)); }
+    Value(void* p) { setPtr(Type::RawPointer, p); }
     
     Value(int32_t i, Type type = Type::Int)
     {
-        _type = type;
         switch(type) {
-            case Type::Bool: _bool = i != 0; break;
-            case Type::Verb:
-            case Type::Float: _float = i; break;
+            case Type::Bool: set(type, (i != 0) ? 1 : 0); break;
+            case Type::Float: set(type, float(i)); break;
             case Type::Int:
-            default: _int = i; 
+            default: set(type, i);
         }
     }
     
-    Type type() const {return _type; }
+    // A Value holding a String, List or Map owns a reference to it. Moving
+    // a Value transfers the reference and leaves Undefined behind, so
+    // shuffling Values around never touches the refcount.
+    Value(const Value& other)
+    {
+        copyRaw(other);
+        retainObject();
+    }
+    
+    Value(Value&& other)
+    {
+        copyRaw(other);
+        other.set(Type::Undefined, 0);
+    }
     
-    bool isBuiltInVerb() const { return int(_type) < m8r::ExternalAtomOffset; }
-    SA builtInVerb() const { assert(isBuiltInVerb()); return static_cast<SA>(_type); }
+    ~Value() { releaseObject(); }
     
-    m8r::SharedPtr<String> string() const
+    // Assign through a temporary so the old object is released last. It
+    // might own the Value being assigned
+    Value& operator=(const Value& other)
     {
-        assert(_type == Type::String);
-        return m8r::SharedPtr<String>(reinterpret_cast<String*>(_ptr));
+        Value tmp(other);
+        swap(tmp);
+        return *this;
     }
     
-    m8r::SharedPtr<List> list() const
+    Value& operator=(Value&& other)
     {
-        assert(_type == Type::List);
-        return m8r::SharedPtr<List>(reinterpret_cast<List*>(_ptr));
+        Value tmp(std::move(other));
+        swap(tmp);
+        return *this;
     }
     
-    m8r::SharedPtr<Map> map() const
+    void swap(Value& other)
     {
-        assert(_type == Type::Map);
-        return m8r::SharedPtr<Map>(reinterpret_cast<Map*>(_ptr));
+        Value tmp;
+        tmp.copyRaw(*this);
+        copyRaw(other);
+        other.copyRaw(tmp);
+        tmp.set(Type::Undefined, 0);
     }
     
+    Type type() const { return (rawType() == Type::ShortString) ? Type::String : rawType(); }
+    bool isShortString() const { return rawType() == Type::ShortString; }
+    bool isFrozen() const { return isObject() && object()->frozen(); }
+    bool isObject() const { return rawType() >= Type::String && rawType() <= Type::Map; }
+    
+    bool isBuiltInVerb() const { return int(rawType()) < m8r::ExternalAtomOffset; }
+    SA builtInVerb() const { assert(isBuiltInVerb()); return static_cast<SA>(rawType()); }
+    
+    // Borrowed access to the object. The pointer is only valid as long as
+    // the Value or some other reference keeps the object alive. Returns
+    // nullptr if the Value is not of the requested type. A short string
+    // has no String object so use toString() for those.
+    String* string() const { return (rawType() == Type::String) ? static_cast<String*>(object()) : nullptr; }
+    List* list() const { return (rawType() == Type::List) ? static_cast<List*>(object()) : nullptr; }
+    Map* map() const { return (rawType() == Type::Map) ? static_cast<Map*>(object()) : nullptr; }
+    
     // FIXME: We need to handle all types here
     int32_t integer() const
     {
-        switch(_type) {
+        switch(rawType()) {
             case Type::String: return string()->string().toInt();
-            case Type::Bool: return _bool ? 1 : 0;
-            case Type::Int: return _int;
-            case Type::Float: return(int32_t(_float));
+            case Type::ShortString: return shortString().toInt();
+            case Type::Int: return rawInt();
+            case Type::Float: return(int32_t(rawFloat()));
             case Type::List:
             case Type::Map: return 0;
 
             // For all other types we assume the value stored is an int
-            default: return _int;
+            default: return rawInt();
         }
     }
     
     float flt() const
     {
-        switch(_type) {
+        switch(rawType()) {
             // FIXME: Do a toFloat conversion
             case Type::String: return string()->string().toFloat();
-            case Type::Bool: return _bool ? 1 : 0;
-            case Type::Int: return _int;
-            case Type::Float: return _float;
+            case Type::ShortString: return shortString().toFloat();
+            case Type::Bool:
+            case Type::Int: return rawInt();
+            case Type::Float: return rawFloat();
             default: return 0;
         }
     }
 
     bool boolean() const
     {
-        switch(_type) {
+        switch(rawType()) {
             // FIXME: Do a toFloat conversion
             case Type::String: return string()->string().toInt() != 0;
-            case Type::Bool: return _bool;
-            case Type::Int: return _int != 0;
-            case Type::Float: return _float != 0;
+            case Type::ShortString: return shortString().toInt() != 0;
+            case Type::Bool:
+            case Type::Int: return rawInt() != 0;
+            case Type::Float: return rawFloat() != 0;
             default: return false;
         }
     }
     
-    void* pointer() const { return (_type == Type::RawPointer) ? _ptr : nullptr; }
+    void* pointer() const { return (rawType() == Type::RawPointer) ? rawPtr() : nullptr; }
     
     void toString(String& str) const
     {
-        switch(_type) {
+        switch(rawType()) {
             case Type::String: str.string() = string()->string(); return;
-            case Type::Bool: str.string() = _bool ? "true" : "false"; return;
-            case Type::Int: str.string() = m8r::String(_int); return;
-            case Type::Float: str.string() = m8r::String(flt()); return;
+            case Type::ShortString: str.string() = shortString(); return;
+            case Type::Bool: str.string() = rawInt() ? "true" : "false"; return;
+            case Type::Int: str.string() = m8r::String(rawInt()); return;
+            case Type::Float: str.string() = m8r::String(rawFloat()); return;
             default: str.string() = "** unimplemented **";
         }
     }
 
     Value property(m8r::Atom prop) const
     {
-        switch(_type) {
+        switch(rawType()) {
             case Type::List:
             case Type::String:
             case Type::Map:
-                assert(_ptr);
-                return reinterpret_cast<ObjectBase*>(_ptr)->property(prop);
+                assert(rawPtr());
+                return object()->property(prop);
             default:
                 return Value();
         }
@@ -210,12 +354,12 @@ public:
     
     void setProperty(m8r::Atom prop, const Value& val)
     {
-        switch(_type) {
+        switch(rawType()) {
             case Type::List:
             case Type::String:
             case Type::Map:
-                assert(_ptr);
-                reinterpret_cast<ObjectBase*>(_ptr)->setProperty(prop, val);
+                assert(rawPtr());
+                object()->setProperty(prop, val);
             default:
                 return;
         }
@@ -223,12 +367,12 @@ public:
     
     Value callProperty(m8r::Atom prop)
     {
-        switch(_type) {
+        switch(rawType()) {
             case Type::List:
             case Type::String:
             case Type::Map:
-                assert(_ptr);
-                return reinterpret_cast<ObjectBase*>(_ptr)->callProperty(prop);
+                assert(rawPtr());
+                return object()->callProperty(prop);
             default:
                 return Value();
         }
@@ -236,37 +380,145 @@ public:
     
     void push_back(const Value& value)
     {
-        if (_type == Type::List) {
+        if (rawType() == Type::List) {
             list()->push_back(value);
+            list()->invalidateCode();
         }
     }
     
     Value operator()(Marly* marly, const Value& value)
     {
-        if (_type != Type::NativeFunction) {
+        if (rawType() != Type::NativeFunction) {
             return Value();
         }
-        return reinterpret_cast<NativeFunction>(_ptr)(marly, value);
+        return reinterpret_cast<NativeFunction>(rawPtr())(marly, value);
     }
 
 private:
     void setValue(Type type, ObjectBase* obj)
     {
-        _type = type;
+        setPtr(type, obj);
+        retainObject();
+    }
+    
+    ObjectBase* object() const { return static_cast<ObjectBase*>(rawPtr()); }
+    
+    m8r::String shortString() const
+    {
+        char chars[MaxShortStringLength + 1];
+        getShortString(chars);
+        return m8r::String(chars);
+    }
+    
+    void retainObject() const
+    {
+        if (isObject()) {
+            object()->retain();
+        }
+    }
+    
+    void releaseObject() const
+    {
+        if (isObject()) {
+            object()->release();
+        }
+    }
+    
+    // All access to the stored type and payload goes through these so the
+    // storage can be laid out differently depending on MARLY_COMPACT_VALUE.
+    // Bool is stored as an int 0 or 1.
+#if MARLY_COMPACT_VALUE
+    // The Type is in the high 16 bits and the payload in the low 48. An int
+    // or float is stored in the low 32 bits. Pointers must fit in 48 bits,
+    // which is true of user space addresses on x86_64 unless 5 level
+    // paging hands out higher ones. A pointer which doesn't fit would be
+    // truncated, so that is always fatal, not just in debug builds.
+    static constexpr uint32_t PayloadBits = 48;
+    static constexpr uint64_t PayloadMask = (uint64_t(1) << PayloadBits) - 1;
+    
+    Type rawType() const { return static_cast<Type>(_bits >> PayloadBits); }
+    int32_t rawInt() const { return int32_t(uint32_t(_bits)); }
+    float rawFloat() const
+    {
+        uint32_t i = uint32_t(_bits);
+        float f;
+        memcpy(&f, &i, sizeof(f));
+        return f;
+    }
+    void* rawPtr() const { return reinterpret_cast<void*>(uintptr_t(_bits & PayloadMask)); }
+    
+    void set(Type type, int32_t i) { _bits = (uint64_t(type) << PayloadBits) | uint32_t(i); }
+    void set(Type type, float f)
+    {
+        uint32_t i;
+        memcpy(&i, &f, sizeof(i));
+        _bits = (uint64_t(type) << PayloadBits) | i;
+    }
+    void setPtr(Type type, void* p)
+    {
+        if ((uint64_t(uintptr_t(p)) & ~PayloadMask) != 0) {
+            ::abort();
+        }
+        _bits = (uint64_t(type) << PayloadBits) | uint64_t(uintptr_t(p));
+    }
+    void copyRaw(const Value& other) { _bits = other._bits; }
+    
+    // Short string chars are packed into the payload, first char lowest.
+    // Unused chars are 0
+    static constexpr size_t MaxShortStringLength = PayloadBits / 8;
+    void setShortString(const char* s, size_t length)
+    {
+        _bits = uint64_t(Type::ShortString) << PayloadBits;
+        for (size_t i = 0; i < length; ++i) {
+            _bits |= uint64_t(uint8_t(s[i])) << (i * 8);
+        }
+    }
+    void getShortString(char* s) const
+    {
+        for (size_t i = 0; i < MaxShortStringLength; ++i) {
+            s[i] = char(_bits >> (i * 8));
+        }
+        s[MaxShortStringLength] = '\0';
+    }
+    
+    uint64_t _bits;
+#else
+    Type rawType() const { return _type; }
+    int32_t rawInt() const { return _int; }
+    float rawFloat() const { return _float; }
+    void* rawPtr() const { return _ptr; }
+    
+    void set(Type type, int32_t i) { _type = type; _ptr = nullptr; _int = i; }
+    void set(Type type, float f) { _type = type; _ptr = nullptr; _float = f; }
+    void setPtr(Type type, void* p) { _type = type; _ptr = p; }
+    void copyRaw(const Value& other) { _type = other._type; _ptr = other._ptr; }
+    
+    // Short string chars are stored in the union. Unused chars are 0
+    static constexpr size_t MaxShortStringLength = sizeof(void*);
+    void setShortString(const char* s, size_t length)
+    {
+        _type = Type::ShortString;
         _ptr = nullptr;
-        m8r::SharedPtr<ObjectBase>* objptr = reinterpret_cast<m8r::SharedPtr<ObjectBase>*>(&_ptr);
-        objptr->reset(obj);
+        memcpy(_chars, s, length);
+    }
+    void getShortString(char* s) const
+    {
+        memcpy(s, _chars, MaxShortStringLength);
+        s[MaxShortStringLength] = '\0';
     }
     
     Type _type;
     union {
-        bool _bool;
         int32_t _int;
         float _float;
         void* _ptr;
+        char _chars[sizeof(void*)];
     };
+#endif
 };
 
+static_assert(!MARLY_COMPACT_VALUE || sizeof(Value) == 8, "compact Value must be 8 bytes");
+
 inline Value ObjectBase::property(m8r::Atom) const { return Value(); }
 inline Value ObjectBase::callProperty(m8r::Atom) { return Value(); }
 inline Value Map::property(m8r::Atom) const { return Value(); }
@@ -274,8 +526,14 @@ inline Value List::property(m8r::Atom) const { return Value(); }
 inline Value String::property(m8r::Atom) const { return Value(); }
 inline void List::setProperty(m8r::Atom prop, const Value& value)
 {
+    // A frozen List belongs to a Program, which may be shared between
+    // threads, and other frames may be running its Code
+    if (frozen()) {
+        return;
+    }
     if (prop == m8r::Atom(static_cast<m8r::Atom::value_type>(SA::length))) {
         resize(value.integer());
+        invalidateCode();
     }
 }
 